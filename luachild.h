@@ -28,18 +28,129 @@ int lc_dir(lua_State *L);
 #define PROCESS_HANDLE "process"
 
 int lc_pipe(lua_State *L);
+#ifdef USE_POSIX
+int lc_splice(lua_State *L);
+int lc_tee(lua_State *L);
+
+#define FD_HANDLE "fd"
+#define BUFFER_HANDLE "buffer"
+
+int lc_rawpipe(lua_State *L);
+int lc_buffer(lua_State *L);
+int rawfd_read(lua_State *L);
+int rawfd_read_into(lua_State *L);
+int rawfd_readv(lua_State *L);
+int rawfd_writev(lua_State *L);
+int rawfd_nonblock(lua_State *L);
+int rawfd_fileno(lua_State *L);
+int rawfd_close(lua_State *L);
+int rawfd_gc(lua_State *L);
+int rawfd_tostring(lua_State *L);
+int buffer_tostring(lua_State *L);
+int buffer_len(lua_State *L);
+int buffer_clear(lua_State *L);
+#endif
 int lc_setenv(lua_State *L);
 int lc_environ(lua_State *L);
+int lc_getenv(lua_State *L);
+int lc_setenv_many(lua_State *L);
 int lc_currentdir(lua_State *L);
 int lc_chdir(lua_State *L);
 int lc_spawn(lua_State *L);
+#ifdef USE_POSIX
+int lc_run(lua_State *L);
+
+#define RUN_STATE_HANDLE "run_state"
+
+int run_state_gc(lua_State *L);
+
+int lc_which(lua_State *L);
+int lc_backend(lua_State *L);
+int lc_engine(lua_State *L);
+
+#define COMMAND_HANDLE "command"
+
+int lc_command(lua_State *L);
+int command_spawn(lua_State *L);
+
+#define ENVBLOCK_HANDLE "envblock"
+
+int lc_envblock(lua_State *L);
+int envblock_with(lua_State *L);
+int envblock_totable(lua_State *L);
+int envblock_len(lua_State *L);
+
+#define POOL_HANDLE "pool"
+
+int lc_pool(lua_State *L);
+int pool_submit(lua_State *L);
+int pool_collect(lua_State *L);
+int pool_call(lua_State *L);
+int pool_close(lua_State *L);
+int pool_gc(lua_State *L);
+
+#define FORKSERVER_HANDLE "forkserver"
+#define FORKCHILD_HANDLE "forkchild"
+
+int lc_forkserver(lua_State *L);
+int forkserver_spawn(lua_State *L);
+int forkserver_close(lua_State *L);
+int forkchild_wait(lua_State *L);
+int forkchild_terminate(lua_State *L);
+int forkchild_pid(lua_State *L);
+int forkchild_gc(lua_State *L);
+
+#define LOOP_HANDLE "loop"
+
+int lc_loop(lua_State *L);
+int loop_gc(lua_State *L);
+int async_wait(lua_State *L);
+int async_read(lua_State *L);
+int async_write(lua_State *L);
+int async_run(lua_State *L);
+
+#define WALKER_HANDLE "walker"
+
+int lc_walk(lua_State *L);
+int diriter_gc(lua_State *L);
+
+#define SCAN_HANDLE "scan"
+
+int lc_scan(lua_State *L);
+int scan_gc(lua_State *L);
+int walker_gc(lua_State *L);
+
+#define PIPELINE_HANDLE "pipeline"
+
+int lc_pipeline(lua_State *L);
+int pipeline_wait(lua_State *L);
+int pipeline_terminate(lua_State *L);
+#endif
 int process_terminate(lua_State *L);
 int process_wait(lua_State *L);
+#ifdef USE_POSIX
+int process_result(lua_State *L);
+int process_fileno(lua_State *L);
+int lc_children(lua_State *L);
+int lc_reaped(lua_State *L);
+
+#define PROCSET_HANDLE "procset"
+
+int lc_procset(lua_State *L);
+int procset_add(lua_State *L);
+int procset_remove(lua_State *L);
+int procset_wait(lua_State *L);
+int procset_close(lua_State *L);
+#endif
 int process_tostring(lua_State *L);
 int process_gc(lua_State *L);
 
 int lua_report_type_error(lua_State *L, int narg, const char * tname);
 size_t lua_value_length(lua_State *L, int index);
+void lua_getuserdatatable(lua_State *L, int index);
+void lua_setuserdatatable(lua_State *L, int index);
+int lua_dumpfunction(lua_State *L, lua_Writer writer, void *data);
+int lua_resumethread(lua_State *L, lua_State *from, int nargs);
 
 int file_handler_creator(lua_State *L, const char * file_path, int get_path_from_env);
 
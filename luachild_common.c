@@ -21,6 +21,10 @@ SHFUNC int luaopen_luachild(lua_State *L)
 
   /* Dirent methods */
   luaL_newmetatable(L, DIR_HANDLE);
+#ifdef USE_POSIX
+  lua_pushcfunction(L, diriter_gc);
+  set_table_field(L, "__gc");
+#endif
   
   /* Process methods */
 
@@ -38,9 +42,216 @@ SHFUNC int luaopen_luachild(lua_State *L)
   lua_pushcfunction(L, process_wait);
   set_table_field(L, "wait");
 
+#ifdef USE_POSIX
+  lua_pushcfunction(L, process_fileno);
+  set_table_field(L, "fileno");
+
+  lua_pushcfunction(L, process_result);
+  set_table_field(L, "result");
+#endif
+
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+
+#ifdef USE_POSIX
+  /* Raw descriptor methods */
+
+  luaL_newmetatable(L, FD_HANDLE);
+
+  lua_pushcfunction(L, rawfd_tostring);
+  set_table_field(L, "__tostring");
+
+  lua_pushcfunction(L, rawfd_gc);
+  set_table_field(L, "__gc");
+
+  lua_pushcfunction(L, rawfd_read);
+  set_table_field(L, "read");
+
+  lua_pushcfunction(L, rawfd_read_into);
+  set_table_field(L, "read_into");
+
+  lua_pushcfunction(L, rawfd_readv);
+  set_table_field(L, "readv");
+
+  lua_pushcfunction(L, rawfd_writev);
+  set_table_field(L, "write");
+
+  lua_pushcfunction(L, rawfd_writev);
+  set_table_field(L, "writev");
+
+  lua_pushcfunction(L, rawfd_nonblock);
+  set_table_field(L, "nonblock");
+
+  lua_pushcfunction(L, rawfd_fileno);
+  set_table_field(L, "fileno");
+
+  lua_pushcfunction(L, rawfd_close);
+  set_table_field(L, "close");
+
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+
+  /* Buffer methods */
+
+  luaL_newmetatable(L, BUFFER_HANDLE);
+
+  lua_pushcfunction(L, buffer_len);
+  set_table_field(L, "__len");
+
+  lua_pushcfunction(L, buffer_tostring);
+  set_table_field(L, "tostring");
+
+  lua_pushcfunction(L, buffer_clear);
+  set_table_field(L, "clear");
+
   lua_pushvalue(L, -1);
   lua_setfield(L, -2, "__index");
 
+  /* State of lc.run, only collected */
+
+  luaL_newmetatable(L, RUN_STATE_HANDLE);
+
+  lua_pushcfunction(L, run_state_gc);
+  set_table_field(L, "__gc");
+
+  /* Command methods */
+
+  luaL_newmetatable(L, COMMAND_HANDLE);
+
+  lua_pushcfunction(L, command_spawn);
+  set_table_field(L, "spawn");
+
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+
+  /* Environment block methods */
+
+  luaL_newmetatable(L, ENVBLOCK_HANDLE);
+
+  lua_pushcfunction(L, envblock_len);
+  set_table_field(L, "__len");
+
+  lua_pushcfunction(L, envblock_with);
+  set_table_field(L, "with");
+
+  lua_pushcfunction(L, envblock_totable);
+  set_table_field(L, "totable");
+
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+
+  /* Worker pool methods */
+
+  luaL_newmetatable(L, POOL_HANDLE);
+
+  lua_pushcfunction(L, pool_gc);
+  set_table_field(L, "__gc");
+
+  lua_pushcfunction(L, pool_submit);
+  set_table_field(L, "submit");
+
+  lua_pushcfunction(L, pool_collect);
+  set_table_field(L, "collect");
+
+  lua_pushcfunction(L, pool_call);
+  set_table_field(L, "call");
+
+  lua_pushcfunction(L, pool_close);
+  set_table_field(L, "close");
+
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+
+  /* Fork server methods */
+
+  luaL_newmetatable(L, FORKSERVER_HANDLE);
+
+  lua_pushcfunction(L, forkserver_close);
+  set_table_field(L, "__gc");
+
+  lua_pushcfunction(L, forkserver_spawn);
+  set_table_field(L, "spawn");
+
+  lua_pushcfunction(L, forkserver_close);
+  set_table_field(L, "close");
+
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+
+  luaL_newmetatable(L, FORKCHILD_HANDLE);
+
+  lua_pushcfunction(L, forkchild_wait);
+  set_table_field(L, "wait");
+
+  lua_pushcfunction(L, forkchild_terminate);
+  set_table_field(L, "terminate");
+
+  lua_pushcfunction(L, forkchild_pid);
+  set_table_field(L, "pid");
+
+  lua_pushcfunction(L, forkchild_gc);
+  set_table_field(L, "__gc");
+
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+
+  /* Event loop */
+
+  luaL_newmetatable(L, LOOP_HANDLE);
+
+  lua_pushcfunction(L, loop_gc);
+  set_table_field(L, "__gc");
+
+  /* Directory walker */
+
+  luaL_newmetatable(L, WALKER_HANDLE);
+
+  lua_pushcfunction(L, walker_gc);
+  set_table_field(L, "__gc");
+
+  /* Parallel scan */
+
+  luaL_newmetatable(L, SCAN_HANDLE);
+
+  lua_pushcfunction(L, scan_gc);
+  set_table_field(L, "__gc");
+
+  /* Pipeline methods */
+
+  luaL_newmetatable(L, PIPELINE_HANDLE);
+
+  lua_pushcfunction(L, pipeline_wait);
+  set_table_field(L, "wait");
+
+  lua_pushcfunction(L, pipeline_terminate);
+  set_table_field(L, "terminate");
+
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+
+  /* Process set methods */
+
+  luaL_newmetatable(L, PROCSET_HANDLE);
+
+  lua_pushcfunction(L, procset_close);
+  set_table_field(L, "__gc");
+
+  lua_pushcfunction(L, procset_add);
+  set_table_field(L, "add");
+
+  lua_pushcfunction(L, procset_remove);
+  set_table_field(L, "remove");
+
+  lua_pushcfunction(L, procset_wait);
+  set_table_field(L, "wait");
+
+  lua_pushcfunction(L, procset_close);
+  set_table_field(L, "close");
+
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+#endif
+
   /* Top module functions */
 
   lua_newtable(L);
@@ -48,12 +259,32 @@ SHFUNC int luaopen_luachild(lua_State *L)
   lua_pushcfunction(L, lc_pipe);
   set_table_field(L, "pipe");
 
+#ifdef USE_POSIX
+  lua_pushcfunction(L, lc_splice);
+  set_table_field(L, "splice");
+
+  lua_pushcfunction(L, lc_tee);
+  set_table_field(L, "tee");
+
+  lua_pushcfunction(L, lc_rawpipe);
+  set_table_field(L, "rawpipe");
+
+  lua_pushcfunction(L, lc_buffer);
+  set_table_field(L, "buffer");
+#endif
+
   lua_pushcfunction(L, lc_setenv);
   set_table_field(L, "setenv");
 
+  lua_pushcfunction(L, lc_setenv_many);
+  set_table_field(L, "setenv_many");
+
   lua_pushcfunction(L, lc_environ);
   set_table_field(L, "environ");
 
+  lua_pushcfunction(L, lc_getenv);
+  set_table_field(L, "getenv");
+
   lua_pushcfunction(L, lc_currentdir);
   set_table_field(L, "currentdir");
 
@@ -69,12 +300,77 @@ SHFUNC int luaopen_luachild(lua_State *L)
   lua_pushcfunction(L, lc_spawn);
   set_table_field(L, "spawn");
 
+#ifdef USE_POSIX
+  lua_pushcfunction(L, lc_run);
+  set_table_field(L, "run");
+
+  lua_pushcfunction(L, lc_pipeline);
+  set_table_field(L, "pipeline");
+
+  lua_pushcfunction(L, lc_command);
+  set_table_field(L, "command");
+
+  lua_pushcfunction(L, lc_pool);
+  set_table_field(L, "pool");
+
+  lua_pushcfunction(L, lc_forkserver);
+  set_table_field(L, "forkserver");
+
+  lua_pushcfunction(L, lc_walk);
+  set_table_field(L, "walk");
+
+  lua_pushcfunction(L, lc_scan);
+  set_table_field(L, "scan");
+
+  lua_pushcfunction(L, lc_loop);
+  set_table_field(L, "loop");
+
+  lua_newtable(L);
+
+  lua_pushcfunction(L, async_wait);
+  set_table_field(L, "wait");
+
+  lua_pushcfunction(L, async_read);
+  set_table_field(L, "read");
+
+  lua_pushcfunction(L, async_write);
+  set_table_field(L, "write");
+
+  lua_pushcfunction(L, async_run);
+  set_table_field(L, "run");
+
+  set_table_field(L, "async");
+
+  lua_pushcfunction(L, lc_which);
+  set_table_field(L, "which");
+
+  lua_pushcfunction(L, lc_backend);
+  set_table_field(L, "backend");
+
+  lua_pushcfunction(L, lc_engine);
+  set_table_field(L, "engine");
+
+  lua_pushcfunction(L, lc_envblock);
+  set_table_field(L, "envblock");
+#endif
+
   lua_pushcfunction(L, process_terminate);
   set_table_field(L, "terminate");
 
   lua_pushcfunction(L, process_wait);
   set_table_field(L, "wait");
 
+#ifdef USE_POSIX
+  lua_pushcfunction(L, lc_procset);
+  set_table_field(L, "procset");
+
+  lua_pushcfunction(L, lc_children);
+  set_table_field(L, "children");
+
+  lua_pushcfunction(L, lc_reaped);
+  set_table_field(L, "reaped");
+#endif
+
   return 1;
 }
 
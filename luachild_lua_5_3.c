@@ -18,6 +18,22 @@ size_t lua_value_length(lua_State *L, int index) {
   return lua_rawlen(L, index);
 }
 
+void lua_getuserdatatable(lua_State *L, int index) {
+  lua_getuservalue(L, index);
+}
+
+void lua_setuserdatatable(lua_State *L, int index) {
+  lua_setuservalue(L, index);
+}
+
+int lua_dumpfunction(lua_State *L, lua_Writer writer, void *data) {
+  return lua_dump(L, writer, data, 0);
+}
+
+int lua_resumethread(lua_State *L, lua_State *from, int nargs) {
+  return lua_resume(L, from, nargs);
+}
+
 static int file_close(lua_State *L) {
   int result = 1;
   FILE **p = (FILE **)luaL_checkudata(L, 1, LUA_FILEHANDLE);
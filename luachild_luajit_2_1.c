@@ -16,6 +16,23 @@ size_t lua_value_length(lua_State *L, int index) {
   return lua_objlen(L, index);
 }
 
+void lua_getuserdatatable(lua_State *L, int index) {
+  lua_getfenv(L, index);
+}
+
+void lua_setuserdatatable(lua_State *L, int index) {
+  lua_setfenv(L, index);
+}
+
+int lua_dumpfunction(lua_State *L, lua_Writer writer, void *data) {
+  return lua_dump(L, writer, data);
+}
+
+int lua_resumethread(lua_State *L, lua_State *from, int nargs) {
+  (void)from;
+  return lua_resume(L, nargs);
+}
+
 static int (*lua_open_func)(lua_State *L) = 0;
 static char * temp_file_path = 0;
 
@@ -27,6 +27,10 @@ THE SOFTWARE.
 
 */
 
+#ifdef __linux__
+#define _GNU_SOURCE /* splice, tee, pipe2 */
+#endif
+
 #include "luachild.h"
 #ifdef USE_POSIX
 
@@ -34,9 +38,19 @@ THE SOFTWARE.
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <stddef.h>
+#include <math.h>
+#include <limits.h>
 
 #include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <pthread.h>
 
 #include <dirent.h>
 #include <sys/stat.h>
@@ -66,6 +80,41 @@ extern char **environ;
 #define OPEN_MAX sysconf(_SC_OPEN_MAX)
 #endif
 
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sched.h>
+
+#ifndef SYS_ioprio_set
+#define SYS_ioprio_set __NR_ioprio_set
+#endif
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_SHIFT 13
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+#ifndef SYS_pidfd_send_signal
+#define SYS_pidfd_send_signal 424
+#endif
+#define HAVE_PIDFD
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+#ifdef IORING_FEAT_RW_CUR_POS           /* reads and writes at the current position */
+#ifndef SYS_io_uring_setup
+#define SYS_io_uring_setup 425
+#endif
+#ifndef SYS_io_uring_enter
+#define SYS_io_uring_enter 426
+#endif
+#define HAVE_IO_URING
+#endif
+#endif
+
 /* -- nil error */
 extern int push_error(lua_State *L)
 {
@@ -76,6 +125,9 @@ extern int push_error(lua_State *L)
 
 /* ----------------------------------------------------------------------------- */
 
+/* Bumped whenever lc_setenv changes the environment */
+static unsigned long environ_version;
+
 /* name value -- true/nil error
  * name nil -- true/nil error */
 int lc_setenv(lua_State *L)
@@ -83,23 +135,85 @@ int lc_setenv(lua_State *L)
   const char *nam = luaL_checkstring(L, 1);
   const char *val = lua_tostring(L, 2);
   int err = val ? setenv(nam, val, 1) : unsetenv(nam);
+  environ_version++;
   if (err == -1) return push_error(L);
   lua_pushboolean(L, 1);
   return 1;
 }
 
+/* {name=value/false...} -- true/nil error */
+int lc_setenv_many(lua_State *L)
+{
+  luaL_checktype(L, 1, LUA_TTABLE);
+  lua_settop(L, 1);
+  environ_version++;
+  lua_pushnil(L);
+  while (lua_next(L, 1)) {              /* tbl k v */
+    const char *nam, *val;
+    int err;
+    if (lua_type(L, -2) != LUA_TSTRING)
+      return luaL_error(L, "expected string for environment variable name, got %s",
+                        luaL_typename(L, -2));
+    nam = lua_tostring(L, -2);
+    val = lua_type(L, -1) == LUA_TBOOLEAN ? 0 : lua_tostring(L, -1);
+    if (!val && lua_toboolean(L, -1))
+      return luaL_error(L, "expected string or false for environment variable value, got %s",
+                        luaL_typename(L, -1));
+    err = val ? setenv(nam, val, 1) : unsetenv(nam);
+    if (err == -1) return push_error(L);
+    lua_pop(L, 1);                      /* tbl k */
+  }
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+/* name -- value/nil */
+int lc_getenv(lua_State *L)
+{
+  const char *val = getenv(luaL_checkstring(L, 1));
+  if (val) lua_pushstring(L, val);
+  else lua_pushnil(L);
+  return 1;
+}
+
+#define ENVIRON_SNAPSHOT "luachild.environ"
+
+/* The snapshot of lc_environ is rebuilt when lc_setenv was called or when
+ * anything else moved environ since it was taken. */
 /* -- environment-table */
 int lc_environ(lua_State *L)
 {
   const char *nam, *val, *end;
   const char **env;
-  lua_newtable(L);
+  lua_getfield(L, LUA_REGISTRYINDEX, ENVIRON_SNAPSHOT);
+  if (lua_istable(L, -1)) {             /* snapshot */
+    int fresh;
+    lua_rawgeti(L, -1, 1);
+    lua_rawgeti(L, -2, 2);              /* snapshot version environ */
+    fresh = lua_tonumber(L, -2) == environ_version
+            && lua_touserdata(L, -1) == (void *)environ;
+    lua_pop(L, 2);
+    if (fresh) {
+      lua_rawgeti(L, -1, 3);            /* snapshot env */
+      return 1;
+    }
+  }
+  lua_createtable(L, 3, 0);
+  lua_pushnumber(L, environ_version);
+  lua_rawseti(L, -2, 1);
+  lua_pushlightuserdata(L, (void *)environ);
+  lua_rawseti(L, -2, 2);
+  lua_pushvalue(L, -1);
+  lua_setfield(L, LUA_REGISTRYINDEX, ENVIRON_SNAPSHOT);
+  lua_newtable(L);                      /* ... snapshot env */
   for (env = (const char **)environ; (nam = *env); env++) {
     end = strchr(val = strchr(nam, '=') + 1, '\0');
     lua_pushlstring(L, nam, val - nam - 1);
     lua_pushlstring(L, val, end - val);
     lua_settable(L, -3);
   }
+  lua_pushvalue(L, -1);
+  lua_rawseti(L, -3, 3);
   return 1;
 }
 
@@ -123,6 +237,7 @@ int lc_chdir(lua_State *L)
   return 1;
 }
 
+#ifndef __linux__
 static int closeonexec(int d)
 {
   int fl = fcntl(d, F_GETFD);
@@ -130,397 +245,5127 @@ static int closeonexec(int d)
     fl = fcntl(d, F_SETFD, fl | FD_CLOEXEC);
   return fl;
 }
+#endif
 
-/* -- in out/nil error */
-int lc_pipe(lua_State *L)
+/* Creates a close-on-exec pipe, tuned by the options table at opts if any:
+ * size (capacity), direct (packet mode) and nonblock */
+static int open_pipe(lua_State *L, int opts, int fd[2])
 {
-  if (!file_handler_creator(L, "/dev/null", 0)) return 0;
-  int fd[2];
+  int flags = 0, size = 0;
+  if (opts > 0 && lua_istable(L, opts)) {
+    lua_getfield(L, opts, "nonblock");
+    if (lua_toboolean(L, -1)) flags |= O_NONBLOCK;
+    lua_getfield(L, opts, "direct");
+    if (lua_toboolean(L, -1)) {
+#ifdef O_DIRECT
+      flags |= O_DIRECT;
+#else
+      lua_pop(L, 2);
+      errno = EINVAL;
+      return -1;
+#endif
+    }
+    lua_getfield(L, opts, "size");
+    if (!lua_isnil(L, -1)) {
+      lua_Number n = lua_tonumber(L, -1);
+      if (lua_type(L, -1) != LUA_TNUMBER || !(n >= 1 && n <= INT_MAX)
+          || n != (int)n)
+        luaL_error(L, "bad size option (positive integer expected)");
+      size = (int)n;
+    }
+    lua_pop(L, 3);
+  }
+#ifdef __linux__
+  if (-1 == pipe2(fd, O_CLOEXEC | flags))
+    return -1;
+#else
   if (-1 == pipe(fd))
-    return push_error(L);
+    return -1;
   closeonexec(fd[0]);
   closeonexec(fd[1]);
-  lua_pushcfile(L, fdopen(fd[0], "r"));
-  lua_pushcfile(L, fdopen(fd[1], "w"));
-  return 2;
+  if (flags & O_NONBLOCK) {
+    fcntl(fd[0], F_SETFL, fcntl(fd[0], F_GETFL) | O_NONBLOCK);
+    fcntl(fd[1], F_SETFL, fcntl(fd[1], F_GETFL) | O_NONBLOCK);
+  }
+#endif
+#ifdef F_SETPIPE_SZ
+  if (size > 0 && -1 == fcntl(fd[1], F_SETPIPE_SZ, size)) {
+    int en = errno;
+    close(fd[0]);
+    close(fd[1]);
+    errno = en;
+    return -1;
+  }
+#endif
+  return 0;
 }
 
-/* ----------------------------------------------------------------------------- */
-
-#ifndef INTERNAL_SPAWN_API
-#include <spawn.h>
-#else
-
-typedef void *posix_spawnattr_t;
-
-typedef struct posix_spawn_file_actions posix_spawn_file_actions_t;
-struct posix_spawn_file_actions {
-  int dups[3];
+struct buffering {
+  int mode;                             /* -1 for the stdio default */
+  size_t size;
 };
 
-static int posix_spawn_file_actions_destroy(
-  posix_spawn_file_actions_t *act)
+/* Reads the buffering option ("none", "line", "full" or a size) of the
+ * options table at opts; raises an error when it is invalid, so it is
+ * checked before any descriptor is opened */
+static void check_buffering(lua_State *L, int opts, struct buffering *b)
 {
-  return 0;
+  b->mode = -1;
+  b->size = 0;
+  if (!lua_istable(L, opts)) return;
+  lua_getfield(L, opts, "buffering");
+  if (lua_type(L, -1) == LUA_TNUMBER) {
+    lua_Number n = lua_tonumber(L, -1);
+    if (!(n > 0 && n <= INT_MAX))
+      luaL_error(L, "bad buffering option (positive size expected)");
+    b->mode = _IOFBF;
+    b->size = (size_t)n;
+  }
+  else if (lua_type(L, -1) == LUA_TSTRING) {
+    const char *mode = lua_tostring(L, -1);
+    if (!strcmp(mode, "none")) b->mode = _IONBF;
+    else if (!strcmp(mode, "line")) {
+      b->mode = _IOLBF;
+      b->size = BUFSIZ;
+    }
+    else if (strcmp(mode, "full"))
+      luaL_error(L, "bad buffering option (\"none\", \"line\", \"full\" or size expected, got \"%s\")", mode);
+  }
+  lua_pop(L, 1);
 }
 
-static int posix_spawn_file_actions_adddup2(
-  posix_spawn_file_actions_t *act,
-  int d,
-  int n)
+static void set_buffering(FILE *f, const struct buffering *b)
 {
-  /* good faith effort to determine validity of descriptors */
-  if (d < 0 || OPEN_MAX < d || n < 0 || OPEN_MAX < n) {
-    errno = EBADF;
-    return -1;
-  }
-  /* we only support duplication to 0,1,2 */
-  if (2 < n) {
-    errno = EINVAL;
-    return -1;
-  }
-  act->dups[n] = d;
-  return 0;
+  if (b->mode != -1) setvbuf(f, 0, b->mode, b->size);
 }
 
-static int posix_spawn_file_actions_init(
-  posix_spawn_file_actions_t *act)
+/* [opts] -- in out/nil error */
+int lc_pipe(lua_State *L)
 {
-  act->dups[0] = act->dups[1] = act->dups[2] = -1;
-  return 0;
+  FILE *in, *out;
+  int fd[2];
+  struct buffering b;
+  check_buffering(L, 1, &b);
+  if (!file_handler_creator(L, "/dev/null", 0)) return 0;
+  if (-1 == open_pipe(L, 1, fd))
+    return push_error(L);
+  in = fdopen(fd[0], "r");
+  out = in ? fdopen(fd[1], "w") : 0;
+  if (!out) {
+    int en = errno;
+    if (in) fclose(in);
+    else close(fd[0]);
+    close(fd[1]);
+    errno = en;
+    return push_error(L);
+  }
+  set_buffering(in, &b);
+  set_buffering(out, &b);
+  lua_pushcfile(L, in);
+  lua_pushcfile(L, out);
+  return 2;
 }
 
-static int posix_spawnp(
-  pid_t *restrict ppid,
-  const char *restrict path,
-  const posix_spawn_file_actions_t *act,
-  const posix_spawnattr_t *restrict attrp,
-  char *const argv[restrict],
-  char *const envp[restrict])
+static FILE *check_file(lua_State *L, int idx, const char *argname)
 {
-  if (!ppid || !path || !argv || !envp)
-    return EINVAL;
-  if (attrp)
-    return EINVAL;
-  switch (*ppid = fork()) {
-  case -1: return -1;
-  default: return 0;
-  case 0:
-    if (act) {
-      int i;
-      for (i = 0; i < 3; i++)
-        if (act->dups[i] != -1 && -1 == dup2(act->dups[i], i))
-          _exit(111);
-    }
-    environ = (char **)envp;
-    execvp(path, argv);
-    _exit(111);
-    /*NOTREACHED*/
+  FILE **pf;
+  if (idx > 0) pf = luaL_checkudata(L, idx, LUA_FILEHANDLE);
+  else {
+    idx = absindex(L, idx);
+    pf = lua_touserdata(L, idx);
+    luaL_getmetatable(L, LUA_FILEHANDLE);
+    if (!pf || !lua_getmetatable(L, idx) || !lua_rawequal(L, -1, -2))
+      luaL_error(L, "bad %s option (%s expected, got %s)",
+                 argname, LUA_FILEHANDLE, luaL_typename(L, idx));
+    lua_pop(L, 2);
   }
+  if (!*pf) return luaL_error(L, "attempt to use a closed file"), NULL;
+  return *pf;
 }
 
-#endif // INTERNAL_SPAWN_API
+/* Returns the userdata at idx if its metatable is the one registered as
+ * tname, NULL otherwise */
+static void *test_udata(lua_State *L, int idx, const char *tname)
+{
+  void *u = lua_touserdata(L, idx);
+  if (u) {
+    idx = absindex(L, idx);
+    luaL_getmetatable(L, tname);
+    if (!lua_getmetatable(L, idx) || !lua_rawequal(L, -1, -2)) u = 0;
+    lua_pop(L, 2);
+  }
+  return u;
+}
 
-struct process {
-  int status;
-  pid_t pid;
+struct rawfd {
+  int fd;
 };
 
-int _process_wait(struct process *p, int blocking, int *status);
-int _process_terminate(struct process *p);
+static int check_rawfd(lua_State *L, int idx)
+{
+  struct rawfd *f = luaL_checkudata(L, idx, FD_HANDLE);
+  if (f->fd == -1) luaL_error(L, "attempt to use a closed descriptor");
+  return f->fd;
+}
 
-int _process_terminate(struct process *p) {
-  if (p->status == -1) {
-    return kill(p->pid, SIGTERM);
-  }
-  return 0;
+/* Accepts both standard files and raw descriptors */
+static int check_fd(lua_State *L, int idx, const char *argname)
+{
+  struct rawfd *f = test_udata(L, idx, FD_HANDLE);
+  if (!f) return fileno(check_file(L, idx, argname));
+  if (f->fd == -1) luaL_error(L, "attempt to use a closed descriptor");
+  return f->fd;
 }
 
-/* proc -- */
-int process_terminate(lua_State *L)
+/* Writes out the data buffered for standard files */
+static void flush_file(lua_State *L, int idx)
 {
-  struct process *p = luaL_checkudata(L, 1, PROCESS_HANDLE);
-  if (-1 == _process_terminate(p)) {
-    return push_error(L);
-  }
-  lua_pushboolean(L, 1);
-  return 1;
+  FILE **pf = test_udata(L, idx, LUA_FILEHANDLE);
+  if (pf && *pf) fflush(*pf);
 }
 
-int _process_wait(struct process *p, int blocking, int *status) {
-  int options = (blocking) ? (0) : (WNOHANG);
-  int ret = waitpid(p->pid, status, options);
-  return ret;
+static void push_rawfd(lua_State *L, int fd)
+{
+  struct rawfd *f = lua_newuserdata(L, sizeof *f);
+  f->fd = fd;
+  luaL_getmetatable(L, FD_HANDLE);
+  lua_setmetatable(L, -2);
 }
 
-/* proc [blocking] -- exitcode/true timeout/nil error */
-int process_wait(lua_State *L)
+/* [opts] -- in out/nil error */
+int lc_rawpipe(lua_State *L)
 {
-  struct process *p = luaL_checkudata(L, 1, PROCESS_HANDLE);
-  int blocking  = 1;                    /* true */
-  int status;
-  if (lua_isboolean(L, 2)) {
-    blocking  = lua_toboolean(L, 2);
-  }
-  if (p->status == -1) {
-    int ret = _process_wait(p, blocking, &status);
-    if (-1 == ret) {
-      return push_error(L);
-    }
-    else if (0 == ret) {
-      lua_pushboolean(L, 1);
-      return 1;
-    }
-    p->status = WEXITSTATUS(status);
-  }
-  lua_pushnumber(L, p->status);
+  int fd[2];
+  if (-1 == open_pipe(L, 1, fd))
+    return push_error(L);
+  push_rawfd(L, fd[0]);
+  push_rawfd(L, fd[1]);
+  return 2;
+}
+
+/* fd -- true/nil error */
+int rawfd_close(lua_State *L)
+{
+  struct rawfd *f = luaL_checkudata(L, 1, FD_HANDLE);
+  int fd = f->fd;
+  f->fd = -1;
+  if (fd != -1 && -1 == close(fd)) return push_error(L);
+  lua_pushboolean(L, 1);
   return 1;
 }
 
-/* proc -- nil */
-int process_gc(lua_State *L) {
-  struct process *p = luaL_checkudata(L, 1, PROCESS_HANDLE);
-  int status;
-  _process_terminate(p);
-  _process_wait(p, 1, &status);
+/* fd -- */
+int rawfd_gc(lua_State *L)
+{
+  struct rawfd *f = luaL_checkudata(L, 1, FD_HANDLE);
+  if (f->fd != -1) close(f->fd);
+  f->fd = -1;
   return 0;
 }
 
-/* proc -- string */
-int process_tostring(lua_State *L)
+/* fd -- integer */
+int rawfd_fileno(lua_State *L)
 {
-  struct process *p = luaL_checkudata(L, 1, PROCESS_HANDLE);
-  char buf[40];
-  lua_pushlstring(L, buf,
-    sprintf(buf, "process (%lu, %s)", (unsigned long)p->pid,
-      p->status==-1 ? "running" : "terminated"));
+  lua_pushinteger(L, check_rawfd(L, 1));
   return 1;
 }
 
-struct spawn_params {
-  lua_State *L;
-  const char *command, **argv, **envp;
-  posix_spawn_file_actions_t redirect;
-};
+/* fd -- string */
+int rawfd_tostring(lua_State *L)
+{
+  struct rawfd *f = luaL_checkudata(L, 1, FD_HANDLE);
+  if (f->fd == -1) lua_pushliteral(L, "fd (closed)");
+  else lua_pushfstring(L, "fd (%d)", f->fd);
+  return 1;
+}
 
-struct spawn_params *spawn_param_init(lua_State *L)
+/* Results of a failed read or write: false when a non-blocking descriptor
+ * is not ready, nil and the error message otherwise */
+static int push_io_error(lua_State *L)
 {
-  struct spawn_params *p = lua_newuserdata(L, sizeof *p);
-  p->L = L;
-  p->command = 0;
-  p->argv = p->envp = 0;
-  posix_spawn_file_actions_init(&p->redirect);
-  return p;
+  if (errno == EAGAIN || errno == EWOULDBLOCK) {
+    lua_pushboolean(L, 0);
+    return 1;
+  }
+  return push_error(L);
 }
 
-static void spawn_param_filename(struct spawn_params *p, const char *filename)
+/* fd nonblock -- true/nil error */
+int rawfd_nonblock(lua_State *L)
 {
-  p->command = filename;
+  int fd = check_rawfd(L, 1);
+  int fl = fcntl(fd, F_GETFL);
+  if (fl != -1)
+    fl = fcntl(fd, F_SETFL, lua_toboolean(L, 2) ? fl | O_NONBLOCK : fl & ~O_NONBLOCK);
+  if (fl == -1) return push_error(L);
+  lua_pushboolean(L, 1);
+  return 1;
 }
 
-static void spawn_param_redirect(struct spawn_params *p, const char *stdname, int fd)
+/* Byte counts are checked before they become a size_t: a negative or huge
+ * number would otherwise turn into a huge allocation */
+#define SIZE_ARG_MAX ((size_t)1 << 31)
+
+static size_t check_size(lua_State *L, int idx)
 {
-  int d;
-  switch (stdname[3]) {
-  case 'i': d = STDIN_FILENO; break;
-  case 'o': d = STDOUT_FILENO; break;
-  case 'e': d = STDERR_FILENO; break;
-  }
-  posix_spawn_file_actions_adddup2(&p->redirect, fd, d);
+  lua_Number n = luaL_checknumber(L, idx);
+  if (!(n >= 0 && n <= (lua_Number)SIZE_ARG_MAX))
+    luaL_argerror(L, idx, "invalid size");
+  return (size_t)n;
 }
 
-static int spawn_param_execute(struct spawn_params *p)
+/* fd n -- string/nil eof/false notready/nil error */
+int rawfd_read(lua_State *L)
 {
-  lua_State *L = p->L;
-  int ret;
-  struct process *proc;
-  if (!p->argv) {
-    p->argv = lua_newuserdata(L, 2 * sizeof *p->argv);
-    p->argv[0] = p->command;
-    p->argv[1] = 0;
+  int fd = check_rawfd(L, 1);
+  size_t len = check_size(L, 2);
+  char stackbuf[4096];
+  char *buf = len > sizeof stackbuf ? lua_newuserdata(L, len) : stackbuf;
+  ssize_t n;
+  do n = read(fd, buf, len);
+  while (n == -1 && errno == EINTR);
+  if (n == -1) return push_io_error(L);
+  if (n == 0 && len > 0) {
+    lua_pushnil(L);
+    return 1;
   }
-  if (!p->envp)
-    p->envp = (const char **)environ;
-  proc = lua_newuserdata(L, sizeof *proc);
-  luaL_getmetatable(L, PROCESS_HANDLE);
-  lua_setmetatable(L, -2);
-  proc->status = -1;
-  ret = posix_spawnp(&proc->pid, p->command, &p->redirect, 0,
-                     (char *const *)p->argv, (char *const *)p->envp);
-  posix_spawn_file_actions_destroy(&p->redirect);
-  return ret != 0 ? push_error(L) : 1;
+  lua_pushlstring(L, buf, n);
+  return 1;
 }
 
-/* Converts a Lua array of strings to a null-terminated array of char pointers.
- * Pops a (0-based) Lua array and replaces it with a userdatum which is the
- * null-terminated C array of char pointers.  The elements of this array point
- * to the strings in the Lua array.  These strings should be associated with
- * this userdatum via a weak table for GC purposes, but they are not here.
- * Therefore, any function which calls this must make sure that these strings
- * remain available until the userdatum is thrown away.
- */
-/* ... array -- ... vector */
-static const char **make_vector(lua_State *L)
+struct buffer {
+  size_t size;
+  size_t len;
+  char data[1];
+};
+
+/* fd buffer -- bytes/nil eof/false notready/nil error */
+int rawfd_read_into(lua_State *L)
 {
-  size_t i, n = lua_value_length(L, -1);
-  const char **vec = lua_newuserdata(L, (n + 2) * sizeof *vec);
-                                        /* ... arr vec */
-  for (i = 0; i <= n; i++) {
-    lua_rawgeti(L, -2, i);              /* ... arr vec elem */
-    vec[i] = lua_tostring(L, -1);
-    if (!vec[i] && i > 0) {
-      luaL_error(L, "expected string for argument %d, got %s",
-                 i, lua_typename(L, lua_type(L, -1)));
-      return 0;
-    }
-    lua_pop(L, 1);                      /* ... arr vec */
+  int fd = check_rawfd(L, 1);
+  struct buffer *b = luaL_checkudata(L, 2, BUFFER_HANDLE);
+  ssize_t n;
+  if (b->len == b->size) return luaL_error(L, "buffer is full");
+  do n = read(fd, b->data + b->len, b->size - b->len);
+  while (n == -1 && errno == EINTR);
+  if (n == -1) return push_io_error(L);
+  if (n == 0) {
+    lua_pushnil(L);
+    return 1;
   }
-  vec[n + 1] = 0;
-  lua_replace(L, -2);                   /* ... vector */
-  return vec;
+  b->len += n;
+  lua_pushnumber(L, n);
+  return 1;
 }
 
-/* ... envtab -- ... envtab vector */
-static void spawn_param_env(struct spawn_params *p)
+#define IOV_MAX_ARGS 64
+
+/* fd n1 n2 ... -- string1 string2 .../nil eof/false notready/nil error */
+int rawfd_readv(lua_State *L)
 {
-  lua_State *L = p->L;
-  size_t i = 0;
-  lua_newtable(L);                      /* ... envtab arr */
-  lua_pushliteral(L, "=");              /* ... envtab arr "=" */
-  lua_pushnil(L);                       /* ... envtab arr "=" nil */
-  for (i = 0; lua_next(L, -4); i++) {   /* ... envtab arr "=" k v */
-    if (!lua_tostring(L, -2)) {
-      luaL_error(L, "expected string for environment variable name, got %s",
-                 lua_typename(L, lua_type(L, -2)));
-      return;
-    }
-    if (!lua_tostring(L, -1)) {
-      luaL_error(L, "expected string for environment variable value, got %s",
-                 lua_typename(L, lua_type(L, -1)));
-      return;
-    }
-    lua_pushvalue(L, -2);               /* ... envtab arr "=" k v k */
-    lua_pushvalue(L, -4);               /* ... envtab arr "=" k v k "=" */
-    lua_pushvalue(L, -3);               /* ... envtab arr "=" k v k "=" v */
-    lua_concat(L, 3);                   /* ... envtab arr "=" k v "k=v" */
-    lua_rawseti(L, -5, i);              /* ... envtab arr "=" k v */
-    lua_pop(L, 1);                      /* ... envtab arr "=" k */
-  }                                     /* ... envtab arr "=" */
-  lua_pop(L, 1);                        /* ... envtab arr */
-  p->envp = make_vector(L);             /* ... envtab arr vector */
+  int fd = check_rawfd(L, 1);
+  int i, cnt = lua_gettop(L) - 1;
+  struct iovec iov[IOV_MAX_ARGS];
+  size_t total = 0;
+  char *buf;
+  ssize_t n;
+  if (cnt < 1 || cnt > IOV_MAX_ARGS)
+    return luaL_error(L, "expected from 1 to %d sizes", IOV_MAX_ARGS);
+  for (i = 0; i < cnt; i++) {
+    iov[i].iov_len = check_size(L, i + 2);
+    total += iov[i].iov_len;
+    if (total > SIZE_ARG_MAX) luaL_argerror(L, i + 2, "invalid size");
+  }
+  buf = lua_newuserdata(L, total ? total : 1);
+  for (i = 0, total = 0; i < cnt; total += iov[i++].iov_len)
+    iov[i].iov_base = buf + total;
+  do n = readv(fd, iov, cnt);
+  while (n == -1 && errno == EINTR);
+  if (n == -1) return push_io_error(L);
+  if (n == 0 && total > 0) {
+    lua_pushnil(L);
+    return 1;
+  }
+  for (i = 0; i < cnt; i++) {
+    size_t l = (size_t)n < iov[i].iov_len ? (size_t)n : iov[i].iov_len;
+    lua_pushlstring(L, iov[i].iov_base, l);
+    n -= l;
+  }
+  return cnt;
 }
 
-/* ... argtab -- ... argtab vector */
-static void spawn_param_args(struct spawn_params *p)
+/* Points iov at the string or buffer at idx */
+static void check_iovec(lua_State *L, int idx, struct iovec *iov)
 {
-  const char **argv = make_vector(p->L);
-  if (!argv[0]) argv[0] = p->command;
-  p->argv = argv;
+  struct buffer *b = test_udata(L, idx, BUFFER_HANDLE);
+  if (b) {
+    iov->iov_base = b->data;
+    iov->iov_len = b->len;
+  }
+  else {
+    iov->iov_base = (void *)luaL_checklstring(L, idx, &iov->iov_len);
+  }
 }
 
-static FILE *check_file(lua_State *L, int idx, const char *argname)
+/* fd data1 data2 ... -- bytes/false notready/nil error */
+int rawfd_writev(lua_State *L)
 {
-  FILE **pf;
-  if (idx > 0) pf = luaL_checkudata(L, idx, LUA_FILEHANDLE);
+  int fd = check_rawfd(L, 1);
+  int i, cnt = lua_gettop(L) - 1;
+  struct iovec iov[IOV_MAX_ARGS];
+  ssize_t n;
+  if (cnt < 1 || cnt > IOV_MAX_ARGS)
+    return luaL_error(L, "expected from 1 to %d strings", IOV_MAX_ARGS);
+  for (i = 0; i < cnt; i++)
+    check_iovec(L, i + 2, &iov[i]);
+  do n = writev(fd, iov, cnt);
+  while (n == -1 && errno == EINTR);
+  if (n == -1) return push_io_error(L);
+  lua_pushnumber(L, n);
+  return 1;
+}
+
+/* size -- buffer */
+int lc_buffer(lua_State *L)
+{
+  size_t size = check_size(L, 1);
+  struct buffer *b;
+  if (size < 1) return luaL_error(L, "buffer size must be positive");
+  b = lua_newuserdata(L, sizeof *b + size - 1);
+  b->size = size;
+  b->len = 0;
+  luaL_getmetatable(L, BUFFER_HANDLE);
+  lua_setmetatable(L, -2);
+  return 1;
+}
+
+/* buffer -- string */
+int buffer_tostring(lua_State *L)
+{
+  struct buffer *b = luaL_checkudata(L, 1, BUFFER_HANDLE);
+  lua_pushlstring(L, b->data, b->len);
+  return 1;
+}
+
+/* buffer -- bytes */
+int buffer_len(lua_State *L)
+{
+  struct buffer *b = luaL_checkudata(L, 1, BUFFER_HANDLE);
+  lua_pushnumber(L, b->len);
+  return 1;
+}
+
+/* buffer -- */
+int buffer_clear(lua_State *L)
+{
+  struct buffer *b = luaL_checkudata(L, 1, BUFFER_HANDLE);
+  b->len = 0;
+  return 0;
+}
+
+/* ----------------------------------------------------------------------------- */
+
+#define RELAY_CHUNK (1 << 16)
+
+/* Writes all the len bytes of buf, returns -1 on error */
+static int write_all(int fd, const char *buf, size_t len)
+{
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+    if (n == -1 && errno == EINTR) continue;
+    if (n == -1) return -1;
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/* Copies up to len bytes (until end of file if len is negative) from in to
+ * out and to out2 if it is not -1, through a user space buffer. Returns the
+ * number of bytes copied, -1 if an error happened before any copy. */
+static long long relay_copy(int in, int out, int out2, long long len)
+{
+  char buf[RELAY_CHUNK];
+  long long total = 0;
+  while (len < 0 || total < len) {
+    size_t want = len < 0 || len - total > RELAY_CHUNK
+                  ? RELAY_CHUNK : (size_t)(len - total);
+    ssize_t n = read(in, buf, want);
+    if (n == -1 && errno == EINTR) continue;
+    if (n <= 0) return n == -1 && total == 0 ? -1 : total;
+    if (-1 == write_all(out, buf, n)) return -1;
+    if (out2 != -1 && -1 == write_all(out2, buf, n)) return -1;
+    total += n;
+  }
+  return total;
+}
+
+#ifdef __linux__
+
+static int is_pipe(int fd)
+{
+  struct stat st;
+  return 0 == fstat(fd, &st) && S_ISFIFO(st.st_mode);
+}
+
+/* Moves exactly len bytes, already waiting in the pipe in, to out */
+static int drain_pipe(int in, int out, size_t len)
+{
+  while (len > 0) {
+    ssize_t n = splice(in, 0, out, 0, len, SPLICE_F_MOVE);
+    if (n == -1 && errno == EINTR) continue;
+    if (n == -1 && errno == EINVAL)
+      return relay_copy(in, out, -1, len) == (long long)len ? 0 : -1;
+    if (n <= 0) return -1;
+    len -= n;
+  }
+  return 0;
+}
+
+/* As relay_copy but the data never leaves the kernel. When neither end is a
+ * pipe, an intermediate one is used. */
+static long long relay_splice(int in, int out, long long len)
+{
+  long long total = 0;
+  int fd[2] = { -1, -1 };
+  if (!is_pipe(in) && !is_pipe(out) && -1 == pipe2(fd, O_CLOEXEC))
+    return -1;
+  while (len < 0 || total < len) {
+    size_t want = len < 0 || len - total > RELAY_CHUNK
+                  ? RELAY_CHUNK : (size_t)(len - total);
+    ssize_t n = splice(in, 0, fd[1] == -1 ? out : fd[1], 0, want, SPLICE_F_MOVE);
+    if (n == -1 && errno == EINTR) continue;
+    if (n == -1 && errno == EINVAL && total == 0) {
+      /* one of the descriptors does not support splicing */
+      total = relay_copy(in, out, -1, len);
+      break;
+    }
+    if (n > 0 && fd[1] != -1 && -1 == drain_pipe(fd[0], out, n)) n = -1;
+    if (n <= 0) {
+      if (n == -1 && total == 0) total = -1;
+      break;
+    }
+    total += n;
+  }
+  if (fd[0] != -1) {
+    int en = errno;
+    close(fd[0]);
+    close(fd[1]);
+    errno = en;
+  }
+  return total;
+}
+
+/* Copies the data of the pipe in to out, then moves it to out2 */
+static long long relay_tee(int in, int out, int out2, long long len)
+{
+  long long total = 0;
+  int fd[2] = { -1, -1 };
+  if (!is_pipe(in)) return relay_copy(in, out, out2, len);
+  if (!is_pipe(out) && -1 == pipe2(fd, O_CLOEXEC)) return -1;
+  while (len < 0 || total < len) {
+    size_t want = len < 0 || len - total > RELAY_CHUNK
+                  ? RELAY_CHUNK : (size_t)(len - total);
+    ssize_t n = tee(in, fd[1] == -1 ? out : fd[1], want, 0);
+    if (n == -1 && errno == EINTR) continue;
+    if (n > 0 && fd[1] != -1 && -1 == drain_pipe(fd[0], out, n)) n = -1;
+    if (n > 0 && relay_splice(in, out2, n) != n) n = -1;
+    if (n <= 0) {
+      if (n == -1 && total == 0) total = -1;
+      break;
+    }
+    total += n;
+  }
+  if (fd[0] != -1) {
+    int en = errno;
+    close(fd[0]);
+    close(fd[1]);
+    errno = en;
+  }
+  return total;
+}
+
+#else
+
+#define relay_splice(in, out, len) relay_copy(in, out, -1, len)
+#define relay_tee(in, out, out2, len) relay_copy(in, out, out2, len)
+
+#endif
+
+/* src dst [nbytes] -- bytes/nil error */
+int lc_splice(lua_State *L)
+{
+  int in = check_fd(L, 1, NULL);
+  int out = check_fd(L, 2, NULL);
+  long long ret;
+  flush_file(L, 2);
+  ret = relay_splice(in, out, luaL_optnumber(L, 3, -1));
+  if (ret == -1) return push_error(L);
+  lua_pushnumber(L, ret);
+  return 1;
+}
+
+/* src dst1 dst2 [nbytes] -- bytes/nil error */
+int lc_tee(lua_State *L)
+{
+  int in = check_fd(L, 1, NULL);
+  int out = check_fd(L, 2, NULL);
+  int out2 = check_fd(L, 3, NULL);
+  long long ret;
+  flush_file(L, 2);
+  flush_file(L, 3);
+  ret = relay_tee(in, out, out2, luaL_optnumber(L, 4, -1));
+  if (ret == -1) return push_error(L);
+  lua_pushnumber(L, ret);
+  return 1;
+}
+
+/* ----------------------------------------------------------------------------- */
+
+#ifndef INTERNAL_SPAWN_API
+#include <spawn.h>
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 34)
+#define HAVE_ADDCLOSEFROM
+#endif
+#endif
+
+struct process {
+  int status;
+  pid_t pid;
+  int pidfd;
+  pid_t pgid;                           /* group it leads, or 0 */
+  int signal, core;                     /* how it terminated */
+  struct rusage rusage;
+  struct timespec start, end;           /* monotonic, for the wall time */
+};
+
+int _process_wait(struct process *p, int timeout, int *status);
+int _process_terminate(struct process *p);
+
+/* Returns a descriptor that becomes readable when the child terminates, or
+ * -1 when the kernel does not support process descriptors. */
+static int pidfd_open_child(pid_t pid)
+{
+#ifdef HAVE_PIDFD
+  return syscall(SYS_pidfd_open, pid, 0);
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+/* fd events timeout -- 1 ready, 0 timeout, -1 error */
+static int poll_fd(int fd, short events, int timeout)
+{
+  struct pollfd pfd;
+  int ret;
+  pfd.fd = fd;
+  pfd.events = events;
+  do ret = poll(&pfd, 1, timeout);
+  while (ret == -1 && errno == EINTR);
+  return ret;
+}
+
+/* Sends a signal to the child, or to the whole process group it was made
+ * the leader of, which may outlive it. Until the leader is reaped its pid
+ * pins the group id; afterwards the id is only safe while a member is left,
+ * as an empty group frees the number for an unrelated process to reuse. */
+static int process_signal(struct process *p, int sig, int group)
+{
+  if (group) {
+    if (p->pgid <= 0) {
+      errno = EINVAL;
+      return -1;
+    }
+    return killpg(p->pgid, sig);
+  }
+  if (p->status == -1 && p->pid > 0) {
+#ifdef HAVE_PIDFD
+    /* the descriptor pins the child, so the pid can not be recycled */
+    if (p->pidfd != -1)
+      return syscall(SYS_pidfd_send_signal, p->pidfd, sig, NULL, 0);
+#endif
+    return kill(p->pid, sig);
+  }
+  return 0;
+}
+
+int _process_terminate(struct process *p) {
+  return process_signal(p, SIGTERM, 0);
+}
+
+static const struct {
+  const char *name;
+  int sig;
+} signal_names[] = {
+  { "HUP", SIGHUP }, { "INT", SIGINT }, { "QUIT", SIGQUIT },
+  { "ILL", SIGILL }, { "TRAP", SIGTRAP }, { "ABRT", SIGABRT },
+  { "BUS", SIGBUS }, { "FPE", SIGFPE }, { "KILL", SIGKILL },
+  { "USR1", SIGUSR1 }, { "SEGV", SIGSEGV }, { "USR2", SIGUSR2 },
+  { "PIPE", SIGPIPE }, { "ALRM", SIGALRM }, { "TERM", SIGTERM },
+  { "CHLD", SIGCHLD }, { "CONT", SIGCONT }, { "STOP", SIGSTOP },
+  { "TSTP", SIGTSTP }, { "TTIN", SIGTTIN }, { "TTOU", SIGTTOU },
+  { "URG", SIGURG }, { "XCPU", SIGXCPU }, { "XFSZ", SIGXFSZ },
+  { "VTALRM", SIGVTALRM }, { "PROF", SIGPROF }, { "WINCH", SIGWINCH },
+  { "SYS", SIGSYS }, { 0, 0 }
+};
+
+/* Gets a signal given by number or by name, with or without "SIG" */
+static int check_signal(lua_State *L, int idx, const char *what)
+{
+  const char *name;
+  int i;
+  if (lua_type(L, idx) == LUA_TNUMBER) {
+    int sig = (int)lua_tonumber(L, idx);
+    if (sig <= 0 || sig >= NSIG)
+      return luaL_error(L, "bad %s (invalid signal number %d)", what, sig);
+    return sig;
+  }
+  name = lua_tostring(L, idx);
+  if (!name)
+    return luaL_error(L, "bad %s (signal name or number expected, got %s)",
+                      what, luaL_typename(L, idx));
+  if (0 == strncmp(name, "SIG", 3)) name += 3;
+  for (i = 0; signal_names[i].name; i++)
+    if (0 == strcmp(name, signal_names[i].name))
+      return signal_names[i].sig;
+  return luaL_error(L, "bad %s (unknown signal %s)", what, lua_tostring(L, idx));
+}
+
+/* proc [{signal=sig, group=bool}] -- true/nil error */
+int process_terminate(lua_State *L)
+{
+  struct process *p = luaL_checkudata(L, 1, PROCESS_HANDLE);
+  int sig = SIGTERM, group = 0;
+  if (!lua_isnoneornil(L, 2)) {
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_getfield(L, 2, "signal");
+    if (!lua_isnil(L, -1)) sig = check_signal(L, -1, "signal option");
+    lua_getfield(L, 2, "group");
+    group = lua_toboolean(L, -1);
+    lua_pop(L, 2);
+  }
+  if (-1 == process_signal(p, sig, group)) {
+    return push_error(L);
+  }
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+/* Waits up to timeout milliseconds (-1 forever, 0 just check) for the child
+ * to terminate. Returns the pid once reaped, 0 on timeout, -1 on error. */
+int _process_wait(struct process *p, int timeout, int *status) {
+  int ret;
+  if (timeout > 0 && p->pidfd != -1) {
+    ret = poll_fd(p->pidfd, POLLIN, timeout);
+    if (ret <= 0) return ret;
+  }
+  else if (timeout > 0) {
+    /* no process descriptor: check again after exponentially longer naps */
+    struct timespec ts;
+    int nap = 1;
+    while (0 == (ret = wait4(p->pid, status, WNOHANG, &p->rusage))) {
+      if (timeout <= 0) return 0;
+      if (nap > timeout) nap = timeout;
+      ts.tv_sec = nap / 1000;
+      ts.tv_nsec = (nap % 1000) * 1000000L;
+      nanosleep(&ts, 0);
+      timeout -= nap;
+      if (nap < 50) nap *= 2;
+    }
+    return ret;
+  }
+  do ret = wait4(p->pid, status, timeout == -1 ? 0 : WNOHANG, &p->rusage);
+  while (ret == -1 && errno == EINTR && timeout == -1);
+  return ret;
+}
+
+/* Registry of the live children, indexed by pid. A child whose handle is
+ * collected while it is still running becomes an orphan: the registry takes
+ * over its pidfd and reaps it later, whenever the module is used again, so
+ * the collector never blocks on it. The exit codes of the collected children
+ * are kept, up to REAPED_MAX of them, until lc.reaped() returns them. */
+
+struct child {
+  pid_t pid;
+  int pidfd;
+  int orphan;
+  struct child *next;
+  struct child *next_orphan;
+};
+
+#define CHILD_BUCKETS 256
+#define REAPED_MAX 256
+
+static pthread_mutex_t children_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct child *children[CHILD_BUCKETS];
+static struct child *orphans;
+static int orphan_count;
+#ifdef __linux__
+static int orphan_epfd = -1;
+#endif
+static struct {
+  pid_t pid;
+  int code;
+} reaped[REAPED_MAX];
+static int reaped_first, reaped_count;
+
+static struct child **child_slot(pid_t pid)
+{
+  struct child **c = &children[(unsigned)pid % CHILD_BUCKETS];
+  while (*c && (*c)->pid != pid) c = &(*c)->next;
+  return c;
+}
+
+/* Records the child in c, allocated before spawning it so that a child is
+ * never left out of the registry */
+static void child_register(struct child *c, pid_t pid)
+{
+  c->pid = pid;
+  c->pidfd = -1;
+  c->orphan = 0;
+  pthread_mutex_lock(&children_lock);
+  c->next = children[(unsigned)pid % CHILD_BUCKETS];
+  children[(unsigned)pid % CHILD_BUCKETS] = c;
+  pthread_mutex_unlock(&children_lock);
+}
+
+/* must be called with children_lock held */
+static void child_unlink(struct child **slot)
+{
+  struct child *c = *slot;
+  *slot = c->next;
+  if (c->orphan) {
+    struct child **o = &orphans;
+    while (*o != c) o = &(*o)->next_orphan;
+    *o = c->next_orphan;
+    orphan_count -= 1;
+    if (c->pidfd != -1) close(c->pidfd);
+  }
+  free(c);
+}
+
+/* Converts a wait status to the exit code reported by process:wait() */
+static int status_code(int status)
+{
+  return WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status);
+}
+
+/* Keeps the exit code of a collected child, dropping the oldest one when
+ * full; must be called with children_lock held */
+static void child_reaped(pid_t pid, int code)
+{
+  int i = (reaped_first + reaped_count) % REAPED_MAX;
+  if (reaped_count == REAPED_MAX)
+    reaped_first = (reaped_first + 1) % REAPED_MAX;
+  else
+    reaped_count += 1;
+  reaped[i].pid = pid;
+  reaped[i].code = code;
+}
+
+static void child_forget(pid_t pid)
+{
+  struct child **slot;
+  pthread_mutex_lock(&children_lock);
+  slot = child_slot(pid);
+  if (*slot) child_unlink(slot);
+  pthread_mutex_unlock(&children_lock);
+}
+
+/* Reaps the orphans that terminated in the meantime */
+static void reap_orphans(void)
+{
+  struct child **o;
+  int status;
+  pthread_mutex_lock(&children_lock);
+  if (!orphan_count) {
+    pthread_mutex_unlock(&children_lock);
+    return;
+  }
+#ifdef __linux__
+  if (orphan_epfd != -1) {
+    struct epoll_event ev[64];
+    int i, n;
+    while (0 < (n = epoll_wait(orphan_epfd, ev, 64, 0))) {
+      for (i = 0; i < n; i++) {
+        pid_t pid = ev[i].data.u32, ret = waitpid(pid, &status, WNOHANG);
+        struct child **slot = child_slot(pid);
+        if (ret == 0) continue;
+        if (ret == pid) child_reaped(pid, status_code(status));
+        if (*slot) child_unlink(slot);  /* also drops the pidfd from epoll */
+      }
+      if (n < 64) break;
+    }
+  }
+#endif
+  /* orphans without a pidfd can only be polled one by one */
+  for (o = &orphans; *o; ) {
+    struct child *c = *o;
+    pid_t ret = c->pidfd == -1 ? waitpid(c->pid, &status, WNOHANG) : 0;
+    if (ret != 0) {
+      if (ret == c->pid) child_reaped(ret, status_code(status));
+      child_unlink(child_slot(c->pid));
+      continue;
+    }
+    o = &c->next_orphan;
+  }
+  pthread_mutex_unlock(&children_lock);
+}
+
+/* Hands a still running child over to the registry, with its pidfd */
+static void child_orphan(struct process *p)
+{
+  struct child *c;
+  pthread_mutex_lock(&children_lock);
+  c = *child_slot(p->pid);
+  if (c && !c->orphan) {
+    c->orphan = 1;
+    c->next_orphan = orphans;
+    orphans = c;
+    orphan_count += 1;
+#ifdef __linux__
+    if (p->pidfd != -1) {
+      struct epoll_event ev;
+      if (orphan_epfd == -1)
+        orphan_epfd = epoll_create1(EPOLL_CLOEXEC);
+      ev.events = EPOLLIN;
+      ev.data.u64 = 0;
+      ev.data.u32 = p->pid;
+      if (orphan_epfd != -1
+          && 0 == epoll_ctl(orphan_epfd, EPOLL_CTL_ADD, p->pidfd, &ev)) {
+        c->pidfd = p->pidfd;
+        p->pidfd = -1;
+      }
+    }
+#endif
+  }
+  pthread_mutex_unlock(&children_lock);
+}
+
+/* -- {pid=code...} */
+int lc_reaped(lua_State *L)
+{
+  pid_t pid[REAPED_MAX];
+  int code[REAPED_MAX];
+  int i, n;
+  reap_orphans();
+  pthread_mutex_lock(&children_lock);   /* copied out, pushing may raise */
+  for (n = 0; n < reaped_count; n++) {
+    pid[n] = reaped[(reaped_first + n) % REAPED_MAX].pid;
+    code[n] = reaped[(reaped_first + n) % REAPED_MAX].code;
+  }
+  reaped_first = reaped_count = 0;
+  pthread_mutex_unlock(&children_lock);
+  lua_createtable(L, 0, n);
+  for (i = 0; i < n; i++) {
+    lua_pushnumber(L, pid[i]);
+    lua_pushnumber(L, code[i]);
+    lua_rawset(L, -3);
+  }
+  return 1;
+}
+
+/* -- {pid...} */
+int lc_children(lua_State *L)
+{
+  int i, n = 0;
+  reap_orphans();
+  lua_newtable(L);
+  pthread_mutex_lock(&children_lock);
+  for (i = 0; i < CHILD_BUCKETS; i++) {
+    struct child *c;
+    for (c = children[i]; c; c = c->next) {
+      lua_pushnumber(L, c->pid);
+      lua_rawseti(L, -2, ++n);
+    }
+  }
+  pthread_mutex_unlock(&children_lock);
+  return 1;
+}
+
+/* Reaps the child if it terminated within timeout milliseconds and records
+ * its exit code, 128 plus the signal number when killed by a signal like
+ * shells do. Returns 1 when terminated, 0 on timeout, -1 on error. */
+static int process_update(struct process *p, int timeout)
+{
+  int status;
+  reap_orphans();
+  if (p->status == -1) {
+    int ret = _process_wait(p, timeout, &status);
+    if (ret <= 0) return ret;
+    clock_gettime(CLOCK_MONOTONIC, &p->end);  /* the reap, not the exit */
+    if (WIFSIGNALED(status)) {
+      p->signal = WTERMSIG(status);
+#ifdef WCOREDUMP
+      p->core = WCOREDUMP(status) != 0;
+#endif
+      p->status = 128 + p->signal;
+    }
+    else {
+      p->status = WEXITSTATUS(status);
+    }
+    child_forget(p->pid);
+  }
+  return 1;
+}
+
+static double timeval_seconds(struct timeval tv)
+{
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* Fills the table on top of the stack with how the process terminated and
+ * what it used */
+static void push_result_fields(lua_State *L, const struct process *p)
+{
+  const struct rusage *ru = &p->rusage;
+#ifdef __APPLE__
+  long maxrss = ru->ru_maxrss / 1024;   /* bytes there, kilobytes elsewhere */
+#else
+  long maxrss = ru->ru_maxrss;
+#endif
+  lua_pushnumber(L, p->status);
+  lua_setfield(L, -2, "code");
+  if (p->signal) {
+    lua_pushnumber(L, p->signal);
+    lua_setfield(L, -2, "signal");
+    lua_pushboolean(L, p->core);
+    lua_setfield(L, -2, "core");
+  }
+  lua_pushnumber(L, timeval_seconds(ru->ru_utime));
+  lua_setfield(L, -2, "utime");
+  lua_pushnumber(L, timeval_seconds(ru->ru_stime));
+  lua_setfield(L, -2, "stime");
+  lua_pushnumber(L, maxrss);
+  lua_setfield(L, -2, "maxrss");
+  lua_pushnumber(L, ru->ru_minflt);
+  lua_setfield(L, -2, "minflt");
+  lua_pushnumber(L, ru->ru_majflt);
+  lua_setfield(L, -2, "majflt");
+  lua_pushnumber(L, ru->ru_nvcsw);
+  lua_setfield(L, -2, "nvcsw");
+  lua_pushnumber(L, ru->ru_nivcsw);
+  lua_setfield(L, -2, "nivcsw");
+  lua_pushnumber(L, (p->end.tv_sec - p->start.tv_sec)
+                    + (p->end.tv_nsec - p->start.tv_nsec) / 1e9);
+  lua_setfield(L, -2, "wall");
+}
+
+/* Converts the optional seconds argument at idx to milliseconds */
+static int opt_timeout(lua_State *L, int idx, int def)
+{
+  lua_Number t;
+  if (!lua_isnumber(L, idx)) return def;
+  t = lua_tonumber(L, idx) * 1000;
+  return t < 0 ? -1 : t > INT_MAX ? INT_MAX : (int)(t + 0.5);
+}
+
+/* proc [blocking/timeout] -- exitcode/true timeout/nil error */
+int process_wait(lua_State *L)
+{
+  struct process *p = luaL_checkudata(L, 1, PROCESS_HANDLE);
+  int timeout = -1;                     /* blocking */
+  int ret;
+  if (lua_isboolean(L, 2)) {
+    timeout = lua_toboolean(L, 2) ? -1 : 0;
+  }
+  else {
+    timeout = opt_timeout(L, 2, -1);
+  }
+  ret = process_update(p, timeout);
+  if (-1 == ret) {
+    return push_error(L);
+  }
+  else if (0 == ret) {
+    lua_pushboolean(L, 1);
+    return 1;
+  }
+  lua_pushnumber(L, p->status);
+  return 1;
+}
+
+/* proc [blocking/timeout] -- result/true timeout/nil error */
+int process_result(lua_State *L)
+{
+  struct process *p = luaL_checkudata(L, 1, PROCESS_HANDLE);
+  int timeout = -1, ret;
+  if (lua_isboolean(L, 2))
+    timeout = lua_toboolean(L, 2) ? -1 : 0;
+  else
+    timeout = opt_timeout(L, 2, -1);
+  ret = process_update(p, timeout);
+  if (-1 == ret) return push_error(L);
+  if (0 == ret) {
+    lua_pushboolean(L, 1);
+    return 1;
+  }
+  lua_newtable(L);
+  push_result_fields(L, p);
+  return 1;
+}
+
+/* proc -- fd/nil error */
+int process_fileno(lua_State *L)
+{
+  struct process *p = luaL_checkudata(L, 1, PROCESS_HANDLE);
+  if (p->pidfd == -1) {
+    errno = ENOSYS;
+    return push_error(L);
+  }
+  lua_pushinteger(L, p->pidfd);
+  return 1;
+}
+
+/* Terminates a child that is still running without waiting for it, handing
+ * it over to the registry. Forgets the pid, so a second call does nothing. */
+static void process_release(struct process *p)
+{
+  if (p->status == -1 && p->pid > 0) {
+    _process_terminate(p);
+    if (1 == process_update(p, 0)) {
+      pthread_mutex_lock(&children_lock);
+      child_reaped(p->pid, p->status);
+      pthread_mutex_unlock(&children_lock);
+    }
+    else
+      child_orphan(p);
+  }
+  p->pid = 0;
+  if (p->pidfd != -1) {
+    close(p->pidfd);
+    p->pidfd = -1;
+  }
+}
+
+/* proc -- nil */
+int process_gc(lua_State *L) {
+  process_release(luaL_checkudata(L, 1, PROCESS_HANDLE));
+  return 0;
+}
+
+/* proc -- string */
+int process_tostring(lua_State *L)
+{
+  struct process *p = luaL_checkudata(L, 1, PROCESS_HANDLE);
+  char buf[40];
+  lua_pushlstring(L, buf,
+    sprintf(buf, "process (%lu, %s)", (unsigned long)p->pid,
+      p->status==-1 ? "running" : "terminated"));
+  return 1;
+}
+
+/* ----------------------------------------------------------------------------- */
+
+struct procset {
+  int epfd;
+  int count;
+};
+
+/* The uservalue of a procset maps each member pidfd to its process handle,
+ * which also keeps the members alive while they are in the set. */
+
+static struct procset *check_procset(lua_State *L, int idx)
+{
+  struct procset *s = luaL_checkudata(L, idx, PROCSET_HANDLE);
+  if (s->epfd == -1) luaL_error(L, "attempt to use a closed process set");
+  return s;
+}
+
+/* -- procset/nil error */
+int lc_procset(lua_State *L)
+{
+#ifdef __linux__
+  struct procset *s = lua_newuserdata(L, sizeof *s);
+  s->count = 0;
+  s->epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (s->epfd == -1) return push_error(L);
+  luaL_getmetatable(L, PROCSET_HANDLE);
+  lua_setmetatable(L, -2);
+  lua_newtable(L);
+  lua_setuserdatatable(L, -2);
+  return 1;
+#else
+  errno = ENOSYS;
+  return push_error(L);
+#endif
+}
+
+/* procset proc -- true/nil error */
+int procset_add(lua_State *L)
+{
+  struct procset *s = check_procset(L, 1);
+  struct process *p = luaL_checkudata(L, 2, PROCESS_HANDLE);
+#ifdef __linux__
+  struct epoll_event ev;
+  if (p->pidfd == -1) {
+    errno = ENOSYS;
+    return push_error(L);
+  }
+  ev.events = EPOLLIN;
+  ev.data.fd = p->pidfd;
+  if (-1 == epoll_ctl(s->epfd, EPOLL_CTL_ADD, p->pidfd, &ev)) {
+    if (errno != EEXIST) return push_error(L);
+  }
+  else {
+    s->count += 1;
+    lua_getuserdatatable(L, 1);         /* set proc members */
+    lua_pushvalue(L, 2);                /* set proc members proc */
+    lua_rawseti(L, -2, p->pidfd);       /* set proc members */
+  }
+#endif
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+/* procset proc -- true/nil error */
+int procset_remove(lua_State *L)
+{
+  struct procset *s = check_procset(L, 1);
+  struct process *p = luaL_checkudata(L, 2, PROCESS_HANDLE);
+#ifdef __linux__
+  if (p->pidfd == -1 || -1 == epoll_ctl(s->epfd, EPOLL_CTL_DEL, p->pidfd, 0))
+    return push_error(L);
+  s->count -= 1;
+  lua_getuserdatatable(L, 1);           /* set proc members */
+  lua_pushnil(L);                       /* set proc members nil */
+  lua_rawseti(L, -2, p->pidfd);         /* set proc members */
+#endif
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+/* procset [timeout] -- {proc=exitcode...}/nil error */
+int procset_wait(lua_State *L)
+{
+  struct procset *s = check_procset(L, 1);
+  int timeout = opt_timeout(L, 2, -1);
+  lua_settop(L, 1);
+  lua_getuserdatatable(L, 1);           /* set members */
+  lua_newtable(L);                      /* set members result */
+#ifdef __linux__
+  if (s->count > 0) {
+    struct epoll_event *ev = lua_newuserdata(L, s->count * sizeof *ev);
+    int i, n;
+    do n = epoll_wait(s->epfd, ev, s->count, timeout);
+    while (n == -1 && errno == EINTR);
+    if (n == -1) return push_error(L);
+    for (i = 0; i < n; i++) {
+      struct process *p;
+      lua_rawgeti(L, 2, ev[i].data.fd); /* set members result events proc */
+      p = lua_touserdata(L, -1);
+      if (p && 1 == process_update(p, 0)) {
+        lua_pushnumber(L, p->status);   /* set members result events proc code */
+        lua_rawset(L, 3);               /* set members result events */
+      }
+      else {
+        /* readable but not reapable (reaped elsewhere): stop watching it, or
+         * the level triggered wait would return it forever */
+        lua_pop(L, 1);                  /* set members result events */
+      }
+      epoll_ctl(s->epfd, EPOLL_CTL_DEL, ev[i].data.fd, 0);
+      s->count -= 1;
+      lua_pushnil(L);
+      lua_rawseti(L, 2, ev[i].data.fd);
+    }
+    lua_pop(L, 1);                      /* set members result */
+  }
+  else if (timeout > 0) {
+    /* nothing can terminate, but the caller still asked to wait that long */
+    while (-1 == poll(0, 0, timeout) && errno == EINTR);
+  }
+#endif
+  return 1;
+}
+
+/* procset -- */
+int procset_close(lua_State *L)
+{
+  struct procset *s = luaL_checkudata(L, 1, PROCSET_HANDLE);
+  if (s->epfd != -1) {
+    close(s->epfd);
+    s->epfd = -1;
+    s->count = 0;
+    lua_newtable(L);
+    lua_setuserdatatable(L, 1);
+  }
+  return 0;
+}
+
+/* Cache of the PATH searches of posix_spawnp. An entry is keyed by the
+ * command name and the value of PATH, and stays valid while none of the
+ * directories searched up to the one holding the command changes. */
+
+#define RESOLVE_SLOTS 64
+
+#ifdef __APPLE__
+#define st_mtim st_mtimespec
+#endif
+
+struct resolved {
+  char *name, *path, *file;             /* command, PATH and the result */
+  size_t ndirs;
+  struct timespec *mtimes;              /* of the directories searched */
+};
+
+static struct resolved resolve_cache[RESOLVE_SLOTS];
+static pthread_mutex_t resolve_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned resolve_hash(const char *name, const char *path)
+{
+  unsigned h = 2166136261u;
+  while (*name) h = (h ^ (unsigned char)*name++) * 16777619u;
+  while (*path) h = (h ^ (unsigned char)*path++) * 16777619u;
+  return h % RESOLVE_SLOTS;
+}
+
+/* Gets the modification time of a PATH directory, zero when missing */
+static void dir_mtime(const char *dir, size_t len, struct timespec *ts)
+{
+  char buf[PATH_MAX];
+  struct stat st;
+  ts->tv_sec = ts->tv_nsec = 0;
+  if (len == 0 || len >= sizeof buf) return;
+  memcpy(buf, dir, len);
+  buf[len] = '\0';
+  if (0 == stat(buf, &st)) *ts = st.st_mtim;
+}
+
+static int resolve_valid(const struct resolved *e)
+{
+  const char *dir = e->path;
+  size_t i;
+  for (i = 0; i < e->ndirs; i++) {
+    const char *end = strchr(dir, ':');
+    size_t len = end ? (size_t)(end - dir) : strlen(dir);
+    struct timespec ts;
+    dir_mtime(dir, len, &ts);
+    if (ts.tv_sec != e->mtimes[i].tv_sec || ts.tv_nsec != e->mtimes[i].tv_nsec)
+      return 0;
+    dir = end + 1;
+  }
+  return 1;
+}
+
+static void resolve_free(struct resolved *e)
+{
+  free(e->name);
+  free(e->path);
+  free(e->file);
+  free(e->mtimes);
+  memset(e, 0, sizeof *e);
+}
+
+/* Searches PATH like execvp, recording the directory times as it goes. The
+ * result is only cached when every directory searched is absolute, as the
+ * others depend on the current directory. */
+static int resolve_search(const char *name, const char *path, char *file)
+{
+  struct resolved e;
+  const char *dir = path;
+  size_t n = 1, namelen = strlen(name);
+  int cacheable = 1, err = ENOENT;
+  for (; *dir; dir++) if (*dir == ':') n++;
+  e.mtimes = malloc(n * sizeof *e.mtimes);
+  if (!e.mtimes) return ENOMEM;
+  for (e.ndirs = 0, dir = path; e.ndirs < n; dir++) {
+    const char *end = strchr(dir, ':');
+    size_t len = end ? (size_t)(end - dir) : strlen(dir);
+    struct stat st;
+    dir_mtime(dir, len, &e.mtimes[e.ndirs++]);
+    if (len == 0 || *dir != '/') cacheable = 0;
+    if (len + namelen + 2 <= PATH_MAX) {
+      if (len == 0) strcpy(file, name);
+      else {
+        memcpy(file, dir, len);
+        file[len] = '/';
+        strcpy(file + len + 1, name);
+      }
+      if (0 == stat(file, &st) && S_ISREG(st.st_mode)
+          && 0 == access(file, X_OK)) {
+        err = 0;
+        break;
+      }
+    }
+    if (!end) break;
+    dir = end;
+  }
+  if (err || !cacheable) {
+    free(e.mtimes);
+    return err;
+  }
+  e.name = strdup(name);
+  e.path = strdup(path);
+  e.file = strdup(file);
+  if (!e.name || !e.path || !e.file) {
+    free(e.name);
+    free(e.path);
+    free(e.file);
+    free(e.mtimes);
+    return 0;
+  }
+  pthread_mutex_lock(&resolve_lock);
+  resolve_free(&resolve_cache[resolve_hash(name, path)]);
+  resolve_cache[resolve_hash(name, path)] = e;
+  pthread_mutex_unlock(&resolve_lock);
+  return 0;
+}
+
+/* Finds the file posix_spawnp would execute for name, which must not contain
+ * a slash; file must hold PATH_MAX bytes. Returns 0 or an errno value. */
+static int resolve_command(const char *name, char *file)
+{
+  const char *path = getenv("PATH");
+  struct resolved *e;
+  if (!path) return ENOENT;
+  pthread_mutex_lock(&resolve_lock);
+  e = &resolve_cache[resolve_hash(name, path)];
+  if (e->name && 0 == strcmp(e->name, name) && 0 == strcmp(e->path, path)
+      && resolve_valid(e)) {
+    strcpy(file, e->file);
+    pthread_mutex_unlock(&resolve_lock);
+    return 0;
+  }
+  pthread_mutex_unlock(&resolve_lock);
+  return resolve_search(name, path, file);
+}
+
+/* name -- pathname/nil error */
+int lc_which(lua_State *L)
+{
+  const char *name = luaL_checkstring(L, 1);
+  char file[PATH_MAX];
+  int err;
+  if (strchr(name, '/')) {
+    if (-1 == access(name, X_OK)) return push_error(L);
+    lua_pushvalue(L, 1);
+    return 1;
+  }
+  err = resolve_command(name, file);
+  if (err) {
+    errno = err;
+    return push_error(L);
+  }
+  lua_pushstring(L, file);
+  return 1;
+}
+
+/* The file actions are kept by spawn_params itself, so that every backend
+ * can apply them. All the dups are applied before the closes, whatever the
+ * order they were added in. The limit fits the most a spawn can need: the
+ * fds option and up to two redirects of each standard stream, each dup
+ * possibly moved out of the way first and its temporary closed, plus the
+ * ranges of close_fds. */
+#define SPAWN_MAX_FDS 32
+#define SPAWN_MAX_ACTIONS (4 * (SPAWN_MAX_FDS + 6))
+
+enum { SPAWN_DUP2, SPAWN_CLOSE, SPAWN_CLOSERANGE };
+
+struct spawn_action {
+  int kind, fd, newfd;                  /* a range closes [fd, newfd) */
+};
+
+struct spawn_actions {
+  int count;
+  int limit;                            /* highest descriptor, plus one */
+  struct spawn_action a[SPAWN_MAX_ACTIONS];
+};
+
+/* What happens to the child before exec, besides the file actions. The
+ * attributes from SPAWN_SETCPUS on have no posix_spawn equivalent. */
+enum {
+  SPAWN_SETPGROUP = 1, SPAWN_SETSID = 2, SPAWN_SETSIGMASK = 4,
+  SPAWN_SETSIGDEF = 8, SPAWN_SETCPUS = 16, SPAWN_SETNICE = 32,
+  SPAWN_SETIOPRIO = 64, SPAWN_SETRLIMITS = 128
+};
+
+#define SPAWN_INTERNAL_ONLY \
+  (SPAWN_SETCPUS | SPAWN_SETNICE | SPAWN_SETIOPRIO | SPAWN_SETRLIMITS)
+
+#define SPAWN_MAX_RLIMITS 16
+
+struct spawn_attrs {
+  int flags;
+  pid_t pgroup;
+  sigset_t sigmask, sigdefault;
+  int nice, ioprio;
+#ifdef __linux__
+  cpu_set_t cpus;
+#endif
+  int nrlimits;
+  struct {
+    int resource;
+    struct rlimit lim;
+  } rlimits[SPAWN_MAX_RLIMITS];
+};
+
+struct spawn_params {
+  lua_State *L;
+  const char *command, **argv, **envp;
+  struct spawn_actions actions;
+  struct spawn_attrs attrs;
+};
+
+struct spawn_params *spawn_param_init(lua_State *L)
+{
+  struct spawn_params *p = lua_newuserdata(L, sizeof *p);
+  p->L = L;
+  p->command = 0;
+  p->argv = p->envp = 0;
+  p->actions.count = 0;
+  p->actions.limit = 0;
+  p->attrs.flags = 0;
+  p->attrs.nrlimits = 0;
+  return p;
+}
+
+static void spawn_param_filename(struct spawn_params *p, const char *filename)
+{
+  p->command = filename;
+}
+
+static void spawn_param_action(struct spawn_params *p, int kind, int fd, int newfd)
+{
+  struct spawn_action *a;
+  if (p->actions.count == SPAWN_MAX_ACTIONS)
+    luaL_error(p->L, "too many file actions (at most %d)", SPAWN_MAX_ACTIONS);
+  a = &p->actions.a[p->actions.count++];
+  a->kind = kind;
+  a->fd = fd;
+  a->newfd = newfd;
+}
+
+static void spawn_param_redirect(struct spawn_params *p, const char *stdname, int fd)
+{
+  int d;
+  switch (stdname[3]) {
+  case 'i': d = STDIN_FILENO; break;
+  case 'o': d = STDOUT_FILENO; break;
+  case 'e': d = STDERR_FILENO; break;
+  default: luaL_error(p->L, "bad redirect '%s'", stdname); return;
+  }
+  spawn_param_action(p, SPAWN_DUP2, fd, d);
+}
+
+/* The dups are a parallel assignment, but they are applied one after the
+ * other: a source that is also the target of another dup would be replaced
+ * before it is read. Such sources are moved first to descriptors free right
+ * now, above any number in use by the actions, and closed once all the dups
+ * are done. Runs at spawn time, so that a command spawned again probes its
+ * temporaries again. Returns 0 or the errno value of the failure. */
+static int spawn_param_resolve(struct spawn_actions *fa)
+{
+  struct spawn_action *a = fa->a;
+  int i, j, n = fa->count, top = 2, tmp[SPAWN_MAX_ACTIONS];
+  int moves = 0;
+  for (i = 0; i < n; i++) {
+    tmp[i] = -1;
+    if (a[i].kind != SPAWN_DUP2) continue;
+    if (a[i].fd > top) top = a[i].fd;
+    if (a[i].newfd > top) top = a[i].newfd;
+    for (j = 0; j < n; j++)
+      if (j != i && a[j].kind == SPAWN_DUP2 && a[j].fd != a[j].newfd
+          && a[j].newfd == a[i].fd && a[i].fd != a[i].newfd) {
+        tmp[i] = 0;
+        moves++;
+        break;
+      }
+  }
+  if (!moves) return 0;
+  if (n + 2 * moves > SPAWN_MAX_ACTIONS) return E2BIG;
+  /* the moves go first, the closes of the temporaries anywhere after */
+  memmove(a + moves, a, n * sizeof *a);
+  memmove(tmp + moves, tmp, n * sizeof *tmp);
+  for (i = moves, j = 0; i < n + moves; i++) {
+    if (tmp[i] == -1) continue;
+    do tmp[i] = ++top; while (fcntl(top, F_GETFD) != -1);
+    a[j].kind = SPAWN_DUP2;
+    a[j].fd = a[i].fd;
+    a[j].newfd = tmp[i];
+    a[n + moves + j].kind = SPAWN_CLOSE;
+    a[n + moves + j].fd = tmp[i];
+    a[n + moves + j].newfd = 0;
+    a[i].fd = tmp[i];
+    j++;
+  }
+  fa->count = n + 2 * moves;
+  return 0;
+}
+
+/* Applies the file actions and executes the command in a new child. Runs
+ * between fork or clone and exec, so it only makes async-signal-safe calls
+ * and, sharing the memory of the parent after vfork, writes nothing of it.
+ * Returns the errno value of the failure. */
+static int spawn_child_exec(const struct spawn_params *p, const char *command,
+                            const char *path, const sigset_t *mask)
+{
+  char file[PATH_MAX];
+  struct sigaction sa;
+  const char *dir, *end;
+  size_t namelen;
+  const struct spawn_attrs *at = &p->attrs;
+  int i, err = ENOENT;
+  /* the handlers of the parent must not run in the child */
+  for (i = 1; i < NSIG; i++) {
+    if (0 == sigaction(i, 0, &sa) && sa.sa_handler != SIG_DFL
+        && (sa.sa_handler != SIG_IGN
+            || (at->flags & SPAWN_SETSIGDEF && sigismember(&at->sigdefault, i)))) {
+      sa.sa_handler = SIG_DFL;
+      sa.sa_flags = 0;
+      sigemptyset(&sa.sa_mask);
+      sigaction(i, &sa, 0);
+    }
+  }
+  if (at->flags & SPAWN_SETSID && -1 == setsid())
+    return errno;
+  if (at->flags & SPAWN_SETPGROUP && -1 == setpgid(0, at->pgroup))
+    return errno;
+  sigprocmask(SIG_SETMASK, at->flags & SPAWN_SETSIGMASK ? &at->sigmask : mask, 0);
+  for (i = 0; i < p->actions.count; i++) {
+    const struct spawn_action *a = &p->actions.a[i];
+    if (a->kind != SPAWN_DUP2) continue;
+    if (a->fd == a->newfd) {
+      /* like posix_spawn, keep the descriptor open across exec */
+      int fl = fcntl(a->fd, F_GETFD);
+      if (fl == -1 || -1 == fcntl(a->fd, F_SETFD, fl & ~FD_CLOEXEC))
+        return errno;
+    }
+    else if (-1 == dup2(a->fd, a->newfd))
+      return errno;
+  }
+  for (i = 0; i < p->actions.count; i++) {
+    const struct spawn_action *a = &p->actions.a[i];
+    int fd;
+    switch (a->kind) {
+    case SPAWN_CLOSE:
+      if (-1 == close(a->fd) && errno != EBADF)
+        return errno;
+      break;
+    case SPAWN_CLOSERANGE:
+#if defined(__linux__) && defined(SYS_close_range)
+      if (0 == syscall(SYS_close_range, a->fd,
+                       a->newfd == INT_MAX ? ~0U : (unsigned)a->newfd - 1, 0))
+        break;
+#endif
+      for (fd = a->fd; fd < a->newfd && fd < p->actions.limit; fd++)
+        close(fd);
+      break;
+    }
+  }
+  /* last, so that a nofile limit does not make the dups above fail */
+  for (i = 0; i < at->nrlimits; i++)
+    if (-1 == setrlimit(at->rlimits[i].resource, &at->rlimits[i].lim))
+      return errno;
+  if (at->flags & SPAWN_SETNICE && -1 == setpriority(PRIO_PROCESS, 0, at->nice))
+    return errno;
+#ifdef __linux__
+  if (at->flags & SPAWN_SETIOPRIO
+      && -1 == syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, at->ioprio))
+    return errno;
+  if (at->flags & SPAWN_SETCPUS
+      && -1 == sched_setaffinity(0, sizeof at->cpus, &at->cpus))
+    return errno;
+#endif
+  if (strchr(command, '/') || !path) {
+    execve(command, (char *const *)p->argv, (char *const *)p->envp);
+    return errno;
+  }
+  /* search PATH like execvp */
+  namelen = strlen(command);
+  for (dir = path; ; dir = end + 1) {
+    size_t len;
+    end = strchr(dir, ':');
+    len = end ? (size_t)(end - dir) : strlen(dir);
+    if (len + namelen + 2 <= sizeof file) {
+      if (len == 0) memcpy(file, command, namelen + 1);
+      else {
+        memcpy(file, dir, len);
+        file[len] = '/';
+        memcpy(file + len + 1, command, namelen + 1);
+      }
+      execve(file, (char *const *)p->argv, (char *const *)p->envp);
+      switch (errno) {
+      case EACCES: err = EACCES; break;
+      case ENOENT: case ENOTDIR: break;
+      default: return errno;
+      }
+    }
+    if (!end) break;
+  }
+  return err;
+}
+
+/* Spawn backends return 0 or the errno value of the failure */
+
+#ifndef INTERNAL_SPAWN_API
+static int spawn_posix(struct spawn_params *p, const char *command, pid_t *pid)
+{
+  const struct spawn_attrs *at = &p->attrs;
+  posix_spawn_file_actions_t fa;
+  posix_spawnattr_t attr;
+  short flags = 0;
+  int i, ret = 0;
+  posix_spawnattr_init(&attr);
+  if (at->flags & SPAWN_SETSID) {
+#ifdef POSIX_SPAWN_SETSID
+    flags |= POSIX_SPAWN_SETSID;
+#else
+    ret = ENOTSUP;
+#endif
+  }
+  if (at->flags & SPAWN_SETPGROUP) {
+    flags |= POSIX_SPAWN_SETPGROUP;
+    posix_spawnattr_setpgroup(&attr, at->pgroup);
+  }
+  if (at->flags & SPAWN_SETSIGMASK) {
+    flags |= POSIX_SPAWN_SETSIGMASK;
+    posix_spawnattr_setsigmask(&attr, &at->sigmask);
+  }
+  if (at->flags & SPAWN_SETSIGDEF) {
+    flags |= POSIX_SPAWN_SETSIGDEF;
+    posix_spawnattr_setsigdefault(&attr, &at->sigdefault);
+  }
+  posix_spawnattr_setflags(&attr, flags);
+  posix_spawn_file_actions_init(&fa);
+  for (i = 0; ret == 0 && i < p->actions.count; i++) {
+    const struct spawn_action *a = &p->actions.a[i];
+    if (a->kind == SPAWN_DUP2)
+      ret = posix_spawn_file_actions_adddup2(&fa, a->fd, a->newfd);
+  }
+  for (i = 0; ret == 0 && i < p->actions.count; i++) {
+    const struct spawn_action *a = &p->actions.a[i];
+    int fd;
+    switch (a->kind) {
+    case SPAWN_CLOSE:
+      ret = posix_spawn_file_actions_addclose(&fa, a->fd);
+      break;
+    case SPAWN_CLOSERANGE:
+#ifdef HAVE_ADDCLOSEFROM
+      if (a->newfd == INT_MAX) {
+        ret = posix_spawn_file_actions_addclosefrom_np(&fa, a->fd);
+        break;
+      }
+#endif
+      /* only the descriptors the child would inherit need a close */
+      for (fd = a->fd; ret == 0 && fd < a->newfd && fd < p->actions.limit; fd++) {
+        int fl = fcntl(fd, F_GETFD);
+        if (fl != -1 && !(fl & FD_CLOEXEC))
+          ret = posix_spawn_file_actions_addclose(&fa, fd);
+      }
+      break;
+    }
+  }
+  if (ret == 0)
+    ret = posix_spawnp(pid, command, &fa, &attr,
+                       (char *const *)p->argv, (char *const *)p->envp);
+  posix_spawn_file_actions_destroy(&fa);
+  posix_spawnattr_destroy(&attr);
+  return ret;
+}
+#endif
+
+/* Copies the whole address space: the child reports its error on a pipe */
+static int spawn_fork(struct spawn_params *p, const char *command, pid_t *pid)
+{
+  const char *path = getenv("PATH");
+  sigset_t all, mask;
+  int fd[2], err = 0;
+  pid_t child;
+  /* created close-on-exec at once, a concurrent fork must not inherit it */
+#ifdef __linux__
+  if (-1 == pipe2(fd, O_CLOEXEC)) return errno;
+#else
+  if (-1 == pipe(fd)) return errno;
+  closeonexec(fd[0]);
+  closeonexec(fd[1]);
+#endif
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &mask);
+  child = fork();
+  if (child == 0) {
+    close(fd[0]);
+    err = spawn_child_exec(p, command, path, &mask);
+    while (-1 == write(fd[1], &err, sizeof err) && errno == EINTR) ;
+    _exit(127);
+  }
+  if (child == -1) err = errno;
+  pthread_sigmask(SIG_SETMASK, &mask, 0);
+  close(fd[1]);
+  if (child != -1) {
+    ssize_t n;
+    do n = read(fd[0], &err, sizeof err); while (n == -1 && errno == EINTR);
+    if (n == sizeof err) waitpid(child, 0, 0);
+    else err = 0;
+  }
+  close(fd[0]);
+  if (!err) *pid = child;
+  return err;
+}
+
+#ifdef __linux__
+/* Shares the address space until the child execs or exits, on a stack of its
+ * own, so that the page tables of a big parent are never copied */
+
+#define SPAWN_STACK_SIZE (64 * 1024)
+
+struct spawn_clone_args {
+  const struct spawn_params *p;
+  const char *command, *path;
+  sigset_t mask;
+  volatile int err;
+};
+
+static int spawn_clone_child(void *arg)
+{
+  struct spawn_clone_args *a = arg;
+  a->err = spawn_child_exec(a->p, a->command, a->path, &a->mask);
+  _exit(127);
+  return 0;
+}
+
+static int spawn_vfork(struct spawn_params *p, const char *command, pid_t *pid)
+{
+  struct spawn_clone_args a;
+  sigset_t all;
+  char *stack;
+  pid_t child;
+  int err = 0;
+  stack = mmap(0, SPAWN_STACK_SIZE, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+  if (stack == MAP_FAILED) return errno;
+  a.p = p;
+  a.command = command;
+  a.path = getenv("PATH");
+  a.err = 0;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &a.mask);
+  /* the parent is suspended until the child execs or exits */
+  child = clone(spawn_clone_child, stack + SPAWN_STACK_SIZE,
+                CLONE_VM | CLONE_VFORK | SIGCHLD, &a);
+  if (child == -1) err = errno;
+  pthread_sigmask(SIG_SETMASK, &a.mask, 0);
+  munmap(stack, SPAWN_STACK_SIZE);
+  if (child != -1 && a.err) {
+    err = a.err;
+    waitpid(child, 0, 0);
+  }
+  if (!err) *pid = child;
+  return err;
+}
+#endif
+
+static const struct spawn_backend {
+  const char *name;
+  int (*spawn)(struct spawn_params *p, const char *command, pid_t *pid);
+} spawn_backends[] = {
+#ifndef INTERNAL_SPAWN_API
+  { "posix", spawn_posix },
+#endif
+#ifdef __linux__
+  { "vfork", spawn_vfork },
+#endif
+  { "fork", spawn_fork },
+  { 0, 0 }
+};
+
+static const struct spawn_backend *spawn_backend = spawn_backends;
+static int spawn_backend_chosen;        /* set by lc.backend(name) */
+
+/* The backend for the attributes posix_spawn can not set: the next one when
+ * posix_spawn is only the default, none when it was chosen explicitly */
+static const struct spawn_backend *spawn_backend_for(const struct spawn_params *p)
+{
+#ifndef INTERNAL_SPAWN_API
+  if (spawn_backend->spawn == spawn_posix
+      && p->attrs.flags & SPAWN_INTERNAL_ONLY)
+    return spawn_backend_chosen ? 0 : spawn_backend + 1;
+#endif
+  return spawn_backend;
+}
+
+/* [name] -- name/nil error */
+int lc_backend(lua_State *L)
+{
+  const char *name = luaL_optstring(L, 1, 0);
+  if (name && !strcmp(name, "default")) {
+    spawn_backend = spawn_backends;
+    spawn_backend_chosen = 0;
+  }
+  else if (name) {
+    const struct spawn_backend *b;
+    for (b = spawn_backends; b->name && strcmp(b->name, name); b++) ;
+    if (!b->name) {
+      lua_pushnil(L);
+      lua_pushfstring(L, "spawn backend '%s' not available", name);
+      return 2;
+    }
+    spawn_backend = b;
+    spawn_backend_chosen = 1;
+  }
+  lua_pushstring(L, spawn_backend->name);
+  return 1;
+}
+
+static int spawn_param_execute(struct spawn_params *p)
+{
+  lua_State *L = p->L;
+  int ret;
+  struct process *proc;
+  const struct spawn_backend *backend = spawn_backend_for(p);
+  const char *command = p->command;
+  char file[PATH_MAX];
+  struct child *c;
+  if (!backend) {
+    lua_pushnil(L);
+    lua_pushfstring(L, "spawn backend '%s' can not apply the rlimits, nice, cpus or ioprio options",
+                    spawn_backend->name);
+    return 2;
+  }
+  if (!p->argv) {
+    p->argv = lua_newuserdata(L, 2 * sizeof *p->argv);
+    p->argv[0] = p->command;
+    p->argv[1] = 0;
+  }
+  if (!p->envp)
+    p->envp = (const char **)environ;
+  reap_orphans();
+  proc = lua_newuserdata(L, sizeof *proc);
+  luaL_getmetatable(L, PROCESS_HANDLE);
+  lua_setmetatable(L, -2);
+  proc->status = -1;
+  proc->pid = 0;
+  proc->pidfd = -1;
+  proc->pgid = 0;
+  proc->signal = proc->core = 0;
+  memset(&proc->rusage, 0, sizeof proc->rusage);
+  clock_gettime(CLOCK_MONOTONIC, &proc->start);
+  proc->end = proc->start;
+  /* a resolved path saves the backend from trying every PATH directory */
+  if (!strchr(p->command, '/') && 0 == resolve_command(p->command, file))
+    command = file;
+  ret = spawn_param_resolve(&p->actions);
+  if (ret != 0) {
+    errno = ret;
+    return push_error(L);
+  }
+  c = malloc(sizeof *c);
+  if (!c) {
+    errno = ENOMEM;
+    return push_error(L);
+  }
+  ret = backend->spawn(p, command, &proc->pid);
+  if (ret != 0) {
+    free(c);
+    errno = ret;
+    proc->pid = 0;
+    return push_error(L);
+  }
+  proc->pidfd = pidfd_open_child(proc->pid);
+  if (p->attrs.flags & SPAWN_SETSID)
+    proc->pgid = proc->pid;
+  else if (p->attrs.flags & SPAWN_SETPGROUP)
+    proc->pgid = p->attrs.pgroup ? p->attrs.pgroup : proc->pid;
+  child_register(c, proc->pid);
+  return 1;
+}
+
+/* Converts a Lua array of strings to a null-terminated array of char pointers.
+ * Pops a Lua array, 0-based or starting at first, and replaces it with a
+ * userdatum which is the null-terminated C array of char pointers.  The
+ * elements of this array point
+ * to the strings in the Lua array.  These strings should be associated with
+ * this userdatum via a weak table for GC purposes, but they are not here.
+ * Therefore, any function which calls this must make sure that these strings
+ * remain available until the userdatum is thrown away.
+ */
+/* ... array -- ... vector */
+static const char **make_vector(lua_State *L, int first)
+{
+  size_t i, n = lua_value_length(L, -1);
+  const char **vec;
+  n = n > (size_t)first ? n - first : 0;
+  vec = lua_newuserdata(L, (n + 2) * sizeof *vec);
+                                        /* ... arr vec */
+  /* the vector keeps its strings, numbers converted included, so that it
+   * stays valid whatever becomes of arr */
+  lua_createtable(L, (int)n + 1, 0);    /* ... arr vec strs */
+  for (i = 0; i <= n; i++) {
+    lua_rawgeti(L, -3, first + i);      /* ... arr vec strs elem */
+    vec[i] = lua_tostring(L, -1);
+    if (!vec[i] && i > 0) {
+      luaL_error(L, "expected string for argument %d, got %s",
+                 i, lua_typename(L, lua_type(L, -1)));
+      return 0;
+    }
+    lua_rawseti(L, -2, (int)i + 1);     /* ... arr vec strs */
+  }
+  vec[n + 1] = 0;
+  lua_setuserdatatable(L, -2);          /* ... arr vec */
+  lua_replace(L, -2);                   /* ... vector */
+  return vec;
+}
+
+/* ... envtab -- ... envtab vector */
+static void spawn_param_env(struct spawn_params *p)
+{
+  lua_State *L = p->L;
+  size_t i = 0;
+  lua_newtable(L);                      /* ... envtab arr */
+  lua_pushliteral(L, "=");              /* ... envtab arr "=" */
+  lua_pushnil(L);                       /* ... envtab arr "=" nil */
+  for (i = 0; lua_next(L, -4); i++) {   /* ... envtab arr "=" k v */
+    if (!lua_tostring(L, -2)) {
+      luaL_error(L, "expected string for environment variable name, got %s",
+                 lua_typename(L, lua_type(L, -2)));
+      return;
+    }
+    if (!lua_tostring(L, -1)) {
+      luaL_error(L, "expected string for environment variable value, got %s",
+                 lua_typename(L, lua_type(L, -1)));
+      return;
+    }
+    lua_pushvalue(L, -2);               /* ... envtab arr "=" k v k */
+    lua_pushvalue(L, -4);               /* ... envtab arr "=" k v k "=" */
+    lua_pushvalue(L, -3);               /* ... envtab arr "=" k v k "=" v */
+    lua_concat(L, 3);                   /* ... envtab arr "=" k v "k=v" */
+    lua_rawseti(L, -5, i);              /* ... envtab arr "=" k v */
+    lua_pop(L, 1);                      /* ... envtab arr "=" k */
+  }                                     /* ... envtab arr "=" */
+  lua_pop(L, 1);                        /* ... envtab arr */
+  p->envp = make_vector(L, 0);          /* ... envtab arr vector */
+}
+
+/* An immutable envp vector built once and shared by any number of spawns */
+struct envblock {
+  size_t count;
+  const char *vars[1];                  /* count variables and a null */
+};
+
+/* Tells whether the "name=value" variable is named in the overlay table */
+static int env_overridden(lua_State *L, int overlay, const char *var)
+{
+  const char *eq = strchr(var, '=');
+  int found;
+  lua_pushlstring(L, var, eq ? (size_t)(eq - var) : strlen(var));
+  lua_rawget(L, overlay);
+  found = !lua_isnil(L, -1);
+  lua_pop(L, 1);
+  return found;
+}
+
+/* Builds a block holding the variables of base not named in the overlay
+ * table followed by the ones the overlay sets, a false value removing the
+ * variable. Only the overlay strings are copied into the block: the caller
+ * must keep base alive as long as the block. */
+/* ... -- ... envblock */
+static struct envblock *envblock_build(lua_State *L,
+                                       const char *const *base, int overlay)
+{
+  struct envblock *b;
+  size_t i, n = 0, bytes = 0;
+  char *s;
+  overlay = absindex(L, overlay);
+  for (i = 0; base && base[i]; i++)
+    if (!env_overridden(L, overlay, base[i])) n++;
+  lua_pushnil(L);
+  while (lua_next(L, overlay)) {        /* ... k v */
+    size_t klen, vlen;
+    if (lua_type(L, -2) != LUA_TSTRING)
+      return luaL_error(L, "expected string for environment variable name, got %s",
+                        luaL_typename(L, -2)), NULL;
+    if (lua_type(L, -1) == LUA_TBOOLEAN && !lua_toboolean(L, -1)) {
+      lua_pop(L, 1);
+      continue;
+    }
+    if (!lua_isstring(L, -1))
+      return luaL_error(L, "expected string for environment variable value, got %s",
+                        luaL_typename(L, -1)), NULL;
+    lua_tolstring(L, -2, &klen);
+    lua_tolstring(L, -1, &vlen);
+    n++;
+    bytes += klen + vlen + 2;
+    lua_pop(L, 1);                      /* ... k */
+  }
+  b = lua_newuserdata(L, offsetof(struct envblock, vars)
+                         + (n + 1) * sizeof b->vars[0] + bytes);
+  luaL_getmetatable(L, ENVBLOCK_HANDLE);
+  lua_setmetatable(L, -2);
+  b->count = 0;
+  s = (char *)(b->vars + n + 1);
+  for (i = 0; base && base[i]; i++)
+    if (!env_overridden(L, overlay, base[i])) b->vars[b->count++] = base[i];
+  lua_pushnil(L);
+  while (lua_next(L, overlay)) {        /* ... envblock k v */
+    size_t klen, vlen;
+    const char *k, *v;
+    if (lua_type(L, -1) != LUA_TBOOLEAN) {
+      k = lua_tolstring(L, -2, &klen);
+      v = lua_tolstring(L, -1, &vlen);
+      b->vars[b->count++] = s;
+      memcpy(s, k, klen);
+      s[klen] = '=';
+      memcpy(s + klen + 1, v, vlen + 1);
+      s += klen + vlen + 2;
+    }
+    lua_pop(L, 1);                      /* ... envblock k */
+  }
+  b->vars[b->count] = 0;
+  return b;
+}
+
+/* tbl -- envblock */
+int lc_envblock(lua_State *L)
+{
+  luaL_checktype(L, 1, LUA_TTABLE);
+  envblock_build(L, 0, 1);
+  return 1;
+}
+
+/* envblock tbl -- envblock */
+int envblock_with(lua_State *L)
+{
+  struct envblock *parent = luaL_checkudata(L, 1, ENVBLOCK_HANDLE);
+  luaL_checktype(L, 2, LUA_TTABLE);
+  envblock_build(L, parent->vars, 2);   /* parent tbl envblock */
+  /* the new block points to the strings of its parent */
+  lua_createtable(L, 1, 0);
+  lua_pushvalue(L, 1);
+  lua_rawseti(L, -2, 1);
+  lua_setuserdatatable(L, -2);
+  return 1;
+}
+
+/* envblock -- tbl */
+int envblock_totable(lua_State *L)
+{
+  struct envblock *b = luaL_checkudata(L, 1, ENVBLOCK_HANDLE);
+  size_t i;
+  lua_createtable(L, 0, b->count);
+  for (i = 0; i < b->count; i++) {
+    const char *eq = strchr(b->vars[i], '=');
+    if (!eq) continue;
+    lua_pushlstring(L, b->vars[i], eq - b->vars[i]);
+    lua_pushstring(L, eq + 1);
+    lua_rawset(L, -3);
+  }
+  return 1;
+}
+
+/* envblock -- count */
+int envblock_len(lua_State *L)
+{
+  struct envblock *b = luaL_checkudata(L, 1, ENVBLOCK_HANDLE);
+  lua_pushnumber(L, b->count);
+  return 1;
+}
+
+/* Applies the env_set, env_unset and env_clear options over the environment
+ * chosen so far, the one of the current process by default. */
+/* cmd opts ... -- cmd opts ... [envblock] */
+static void spawn_param_overlay(struct spawn_params *p)
+{
+  lua_State *L = p->L;
+  const char *const *base = p->envp ? p->envp : (const char *const *)environ;
+  int overlay;
+  lua_getfield(L, 2, "env_clear");
+  if (lua_toboolean(L, -1)) base = 0;
+  lua_getfield(L, 2, "env_unset");
+  lua_getfield(L, 2, "env_set");        /* ... clear unset set */
+  if (base && lua_isnil(L, -1) && lua_isnil(L, -2)) {
+    lua_pop(L, 3);
+    return;
+  }
+  lua_newtable(L);                      /* ... clear unset set overlay */
+  overlay = lua_gettop(L);
+  if (!lua_isnil(L, -3)) {
+    size_t i, n;
+    if (!lua_istable(L, -3))
+      luaL_error(L, "bad env_unset option (table expected, got %s)",
+                 luaL_typename(L, -3));
+    n = lua_value_length(L, -3);
+    for (i = 1; i <= n; i++) {
+      lua_rawgeti(L, overlay - 2, i);
+      lua_pushboolean(L, 0);
+      lua_rawset(L, overlay);
+    }
+  }
+  if (!lua_isnil(L, -2)) {
+    if (!lua_istable(L, -2))
+      luaL_error(L, "bad env_set option (table expected, got %s)",
+                 luaL_typename(L, -2));
+    lua_pushnil(L);
+    while (lua_next(L, overlay - 1)) {  /* ... overlay k v */
+      lua_pushvalue(L, -2);
+      lua_insert(L, -2);                /* ... overlay k k v */
+      lua_rawset(L, overlay);           /* ... overlay k */
+    }
+  }
+  p->envp = envblock_build(L, base, overlay)->vars;
+  lua_replace(L, overlay - 3);          /* ... envblock unset set overlay */
+  lua_pop(L, 3);                        /* ... envblock */
+}
+
+/* ... argtab -- ... argtab vector */
+static void spawn_param_args(struct spawn_params *p, int first)
+{
+  const char **argv = make_vector(p->L, first);
+  if (!argv[0]) argv[0] = p->command;
+  p->argv = argv;
+}
+
+#define new_dirent(L) lua_newtable(L)
+
+/* Applies the fds option, a map from child descriptors to files, and the
+ * close_fds one, which closes everything else but the standard streams. */
+/* cmd opts ... -- cmd opts ... */
+static void spawn_param_fds(struct spawn_params *p)
+{
+  lua_State *L = p->L;
+  int target[SPAWN_MAX_FDS], source;
+  int i, n = 0;
+  lua_getfield(L, 2, "fds");            /* cmd opts ... fds */
+  if (!lua_isnil(L, -1)) {
+    if (!lua_istable(L, -1))
+      luaL_error(L, "bad fds option (table expected, got %s)",
+                 luaL_typename(L, -1));
+    lua_pushnil(L);
+    while (lua_next(L, -2)) {           /* cmd opts ... fds k v */
+      lua_Number k = lua_tonumber(L, -2);
+      if (lua_type(L, -2) != LUA_TNUMBER || k < 0 || k != (int)k)
+        luaL_error(L, "bad fds option (descriptor numbers expected as keys)");
+      if (n == SPAWN_MAX_FDS)
+        luaL_error(L, "bad fds option (at most %d descriptors)", SPAWN_MAX_FDS);
+      target[n++] = (int)k;
+      source = check_fd(L, -1, "fds");
+      spawn_param_action(p, SPAWN_DUP2, source, (int)k);
+      lua_pop(L, 1);                    /* cmd opts ... fds k */
+    }
+  }
+  lua_pop(L, 1);                        /* cmd opts ... */
+  lua_getfield(L, 2, "close_fds");      /* cmd opts ... close */
+  if (lua_toboolean(L, -1)) {
+    int lo = 3;
+    long limit = sysconf(_SC_OPEN_MAX);
+    p->actions.limit = limit < 0 || limit > INT_MAX ? INT_MAX : (int)limit;
+    /* close the gaps between the mapped descriptors, then all the rest */
+    for (;;) {
+      int hi = INT_MAX;
+      for (i = 0; i < n; i++)
+        if (target[i] >= lo && target[i] < hi) hi = target[i];
+      if (hi > lo) spawn_param_action(p, SPAWN_CLOSERANGE, lo, hi);
+      if (hi == INT_MAX) break;
+      lo = hi + 1;
+    }
+  }
+  lua_pop(L, 1);                        /* cmd opts ... */
+}
+
+/* Reads a list of signals, or true for all of them, into a set */
+/* ... list -- ... */
+static void check_sigset(lua_State *L, sigset_t *set, const char *what)
+{
+  size_t i, n;
+  sigemptyset(set);
+  if (lua_type(L, -1) == LUA_TBOOLEAN && lua_toboolean(L, -1)) {
+    sigfillset(set);
+    return;
+  }
+  if (!lua_istable(L, -1))
+    luaL_error(L, "bad %s (table expected, got %s)", what, luaL_typename(L, -1));
+  n = lua_value_length(L, -1);
+  for (i = 1; i <= n; i++) {
+    lua_rawgeti(L, -1, i);
+    sigaddset(set, check_signal(L, -1, what));
+    lua_pop(L, 1);
+  }
+}
+
+/* Applies the pgroup, setsid, sigmask and sigdefault options */
+/* cmd opts ... -- cmd opts ... */
+static void spawn_param_attrs(struct spawn_params *p)
+{
+  lua_State *L = p->L;
+  struct spawn_attrs *at = &p->attrs;
+  lua_getfield(L, 2, "pgroup");
+  if (lua_type(L, -1) == LUA_TBOOLEAN) {
+    if (lua_toboolean(L, -1)) {
+      at->flags |= SPAWN_SETPGROUP;
+      at->pgroup = 0;
+    }
+  }
+  else if (!lua_isnil(L, -1)) {
+    if (lua_type(L, -1) != LUA_TNUMBER || lua_tonumber(L, -1) < 0)
+      luaL_error(L, "bad pgroup option (process group id expected)");
+    at->flags |= SPAWN_SETPGROUP;
+    at->pgroup = (pid_t)lua_tonumber(L, -1);
+  }
+  lua_getfield(L, 2, "setsid");
+  if (lua_toboolean(L, -1)) at->flags |= SPAWN_SETSID;
+  lua_pop(L, 2);
+  lua_getfield(L, 2, "sigmask");
+  if (!lua_isnil(L, -1)) {
+    at->flags |= SPAWN_SETSIGMASK;
+    check_sigset(L, &at->sigmask, "sigmask option");
+  }
+  lua_getfield(L, 2, "sigdefault");
+  if (!lua_isnil(L, -1)) {
+    at->flags |= SPAWN_SETSIGDEF;
+    check_sigset(L, &at->sigdefault, "sigdefault option");
+  }
+  lua_pop(L, 2);
+}
+
+static const struct {
+  const char *name;
+  int resource;
+} rlimit_names[] = {
+  { "as", RLIMIT_AS }, { "core", RLIMIT_CORE }, { "cpu", RLIMIT_CPU },
+  { "data", RLIMIT_DATA }, { "fsize", RLIMIT_FSIZE },
+  { "nofile", RLIMIT_NOFILE }, { "stack", RLIMIT_STACK },
+#ifdef RLIMIT_NPROC
+  { "nproc", RLIMIT_NPROC },
+#endif
+#ifdef RLIMIT_MEMLOCK
+  { "memlock", RLIMIT_MEMLOCK },
+#endif
+  { 0, 0 }
+};
+
+static rlim_t check_rlim(lua_State *L, int idx, const char *name)
+{
+  lua_Number n;
+  if (lua_type(L, idx) != LUA_TNUMBER || (n = lua_tonumber(L, idx)) < 0)
+    return luaL_error(L, "bad rlimits option (number expected for %s)", name);
+  return n == HUGE_VAL ? RLIM_INFINITY : (rlim_t)n;
+}
+
+/* Applies the cpus, nice, ioprio and rlimits options */
+/* cmd opts ... -- cmd opts ... */
+static void spawn_param_limits(struct spawn_params *p)
+{
+  lua_State *L = p->L;
+  struct spawn_attrs *at = &p->attrs;
+  lua_getfield(L, 2, "cpus");
+  if (!lua_isnil(L, -1)) {
+#ifdef __linux__
+    size_t i, n;
+    luaL_checktype(L, -1, LUA_TTABLE);
+    CPU_ZERO(&at->cpus);
+    n = lua_value_length(L, -1);
+    for (i = 1; i <= n; i++) {
+      lua_Number cpu;
+      lua_rawgeti(L, -1, i);
+      cpu = lua_tonumber(L, -1);
+      if (lua_type(L, -1) != LUA_TNUMBER || cpu < 0 || cpu >= CPU_SETSIZE)
+        luaL_error(L, "bad cpus option (cpu numbers expected)");
+      CPU_SET((int)cpu, &at->cpus);
+      lua_pop(L, 1);
+    }
+    at->flags |= SPAWN_SETCPUS;
+#else
+    luaL_error(L, "the cpus option is not supported on this system");
+#endif
+  }
+  lua_getfield(L, 2, "nice");
+  if (!lua_isnil(L, -1)) {
+    if (lua_type(L, -1) != LUA_TNUMBER)
+      luaL_error(L, "bad nice option (number expected, got %s)",
+                 luaL_typename(L, -1));
+    at->nice = (int)lua_tonumber(L, -1);
+    at->flags |= SPAWN_SETNICE;
+  }
+  lua_pop(L, 2);
+  lua_getfield(L, 2, "ioprio");
+  if (!lua_isnil(L, -1)) {
+#ifdef __linux__
+    static const char *const classes[] = { "realtime", "best-effort", "idle", 0 };
+    int class, level = 4;
+    if (lua_istable(L, -1)) {
+      lua_getfield(L, -1, "level");
+      if (!lua_isnil(L, -1)) level = (int)lua_tonumber(L, -1);
+      lua_getfield(L, -2, "class");
+      lua_replace(L, -3);
+      lua_pop(L, 1);
+    }
+    for (class = 0; classes[class]; class++)
+      if (lua_isstring(L, -1) && 0 == strcmp(classes[class], lua_tostring(L, -1)))
+        break;
+    if (!classes[class])
+      luaL_error(L, "bad ioprio option (realtime, best-effort or idle expected)");
+    if (level < 0 || level > 7)
+      luaL_error(L, "bad ioprio option (level between 0 and 7 expected)");
+    at->ioprio = (class + 1) << IOPRIO_CLASS_SHIFT | (class == 2 ? 0 : level);
+    at->flags |= SPAWN_SETIOPRIO;
+#else
+    luaL_error(L, "the ioprio option is not supported on this system");
+#endif
+  }
+  lua_pop(L, 1);
+  lua_getfield(L, 2, "rlimits");
+  if (!lua_isnil(L, -1)) {
+    luaL_checktype(L, -1, LUA_TTABLE);
+    lua_pushnil(L);
+    while (lua_next(L, -2)) {           /* ... rlimits k v */
+      const char *name;
+      int i;
+      if (lua_type(L, -2) != LUA_TSTRING)
+        luaL_error(L, "bad rlimits option (resource names expected as keys)");
+      name = lua_tostring(L, -2);
+      for (i = 0; rlimit_names[i].name; i++)
+        if (0 == strcmp(name, rlimit_names[i].name)) break;
+      if (!rlimit_names[i].name)
+        luaL_error(L, "bad rlimits option (unknown resource %s)", name);
+      if (at->nrlimits == SPAWN_MAX_RLIMITS)
+        luaL_error(L, "bad rlimits option (too many resources)");
+      at->rlimits[at->nrlimits].resource = rlimit_names[i].resource;
+      if (lua_istable(L, -1)) {         /* {soft, hard} */
+        lua_rawgeti(L, -1, 1);
+        lua_rawgeti(L, -2, 2);
+        at->rlimits[at->nrlimits].lim.rlim_cur = check_rlim(L, -2, name);
+        at->rlimits[at->nrlimits].lim.rlim_max = check_rlim(L, -1, name);
+        lua_pop(L, 2);
+      }
+      else {
+        at->rlimits[at->nrlimits].lim.rlim_cur =
+          at->rlimits[at->nrlimits].lim.rlim_max = check_rlim(L, -1, name);
+      }
+      at->nrlimits++;
+      lua_pop(L, 1);                    /* ... rlimits k */
+    }
+    at->flags |= SPAWN_SETRLIMITS;
+  }
+  lua_pop(L, 1);
+}
+
+static void get_redirect(lua_State *L,
+                         int idx, const char *stdname, struct spawn_params *p)
+{
+  lua_getfield(L, idx, stdname);
+  if (!lua_isnil(L, -1))
+    spawn_param_redirect(p, stdname, check_fd(L, -1, stdname));
+  lua_pop(L, 1);
+}
+
+/* Collects the spawn parameters from the arguments of lc_spawn. On return
+ * the command is at index 1 and the options table, if any, at index 2. */
+/* filename [args-opts] -- cmd [opts] ... */
+/* args-opts -- cmd opts ... */
+static struct spawn_params *spawn_prepare(lua_State *L)
+{
+  struct spawn_params *params;
+  int have_options, first = 0;
+  switch (lua_type(L, 1)) {
+  default: return lua_report_type_error(L, 1, "string or table"), NULL;
+  case LUA_TSTRING:
+    switch (lua_type(L, 2)) {
+    default: return lua_report_type_error(L, 2, "table"), NULL;
+    case LUA_TNONE: case LUA_TNIL: have_options = 0; break;
+    case LUA_TTABLE: have_options = 1; break;
+    }
+    break;
+  case LUA_TTABLE:
+    have_options = 1;
+    lua_getfield(L, 1, "command");      /* opts ... cmd */
+    if (!lua_isnil(L, -1)) {
+      /* convert {command=command,arg1,...} to command {arg1,...} */
+      lua_insert(L, 1);                 /* cmd opts ... */
+    }
+    else {
+      /* read {arg0,arg1,...} as arg0 {arg1,...}, leaving the table as is */
+      lua_pop(L, 1);                    /* opts ... */
+      lua_rawgeti(L, 1, 1);             /* opts ... cmd */
+      lua_insert(L, 1);                 /* cmd opts ... */
+      first = 1;
+    }
+    if (lua_type(L, 1) != LUA_TSTRING)
+      return luaL_error(L, "bad command option (string expected, got %s)",
+                        luaL_typename(L, 1)), NULL;
+    break;
+  }
+  params = spawn_param_init(L);
+  /* get filename to execute */
+  spawn_param_filename(params, lua_tostring(L, 1));
+  /* get arguments, environment, and redirections */
+  if (have_options) {
+    lua_getfield(L, 2, "args");         /* cmd opts ... argtab */
+    switch (lua_type(L, -1)) {
+    default:
+      return luaL_error(L, "bad args option (table expected, got %s)",
+                        luaL_typename(L, -1)), NULL;
+    case LUA_TNIL:
+      lua_pop(L, 1);                    /* cmd opts ... */
+      lua_pushvalue(L, 2);              /* cmd opts ... opts */
+      spawn_param_args(params, first);  /* cmd opts ... */
+      break;
+    case LUA_TTABLE:
+      if (lua_value_length(L, 2) > (size_t)first)
+        return
+          luaL_error(L, "cannot specify both the args option and array values"), NULL;
+      spawn_param_args(params, 0);      /* cmd opts ... */
+      break;
+    }
+    lua_getfield(L, 2, "env");          /* cmd opts ... envtab */
+    switch (lua_type(L, -1)) {
+    default:
+      return luaL_error(L, "bad env option (table or envblock expected, got %s)",
+                        luaL_typename(L, -1)), NULL;
+    case LUA_TNIL:
+      break;
+    case LUA_TUSERDATA:
+      /* the block stays referenced by the options */
+      params->envp = ((struct envblock *)
+                      luaL_checkudata(L, -1, ENVBLOCK_HANDLE))->vars;
+      break;
+    case LUA_TTABLE:
+      spawn_param_env(params);          /* cmd opts ... */
+      break;
+    }
+    spawn_param_overlay(params);        /* cmd opts ... */
+    get_redirect(L, 2, "stdin", params);    /* cmd opts ... */
+    get_redirect(L, 2, "stdout", params);   /* cmd opts ... */
+    get_redirect(L, 2, "stderr", params);   /* cmd opts ... */
+    spawn_param_fds(params);            /* cmd opts ... */
+    spawn_param_attrs(params);          /* cmd opts ... */
+    spawn_param_limits(params);         /* cmd opts ... */
+  }
+  return params;
+}
+
+/* filename [args-opts] -- proc/nil error */
+/* args-opts -- proc/nil error */
+int lc_spawn(lua_State *L)
+{
+  struct spawn_params *params = spawn_prepare(L);
+  if (!params) return 0;
+  return spawn_param_execute(params);   /* proc/nil error */
+}
+
+/* ----------------------------------------------------------------------------- */
+
+/* Output of a child collected by lc_run */
+struct capture {
+  int fd;
+  char *buf;
+  size_t len, size;
+};
+
+/* State of a child being fed and drained by lc_run */
+struct run_state {
+  int in_fd;
+  const char *input;
+  size_t input_len, input_pos;
+  struct capture out[2];                /* stdout, stderr */
+  size_t max_output;                    /* 0 for no limit */
+  int truncated;
+};
+
+static void run_init(struct run_state *st)
+{
+  st->in_fd = st->out[0].fd = st->out[1].fd = -1;
+  st->input = 0;
+  st->input_len = st->input_pos = 0;
+  st->out[0].buf = st->out[1].buf = 0;
+  st->out[0].len = st->out[0].size = st->out[1].len = st->out[1].size = 0;
+  st->max_output = 0;
+  st->truncated = 0;
+}
+
+static void close_fd(int *fd)
+{
+  if (*fd != -1) close(*fd);
+  *fd = -1;
+}
+
+static int set_nonblock(int fd)
+{
+  int fl = fcntl(fd, F_GETFL);
+  return fl == -1 ? -1 : fcntl(fd, F_SETFL, fl | O_NONBLOCK);
+}
+
+/* Writes the next chunk of input. SIGPIPE must be blocked by the caller. */
+static int run_write(struct run_state *st)
+{
+  ssize_t n;
+  do n = write(st->in_fd, st->input + st->input_pos,
+               st->input_len - st->input_pos);
+  while (n == -1 && errno == EINTR);
+  if (n == -1 && errno == EAGAIN) return 0;
+  if (n == -1 && errno != EPIPE) return -1;
+  if (n > 0) st->input_pos += n;
+  if (n == -1 || st->input_pos == st->input_len)
+    close_fd(&st->in_fd);               /* done, or the child stopped reading */
+  return 0;
+}
+
+/* Reads what is available on the output c */
+static int run_read(struct run_state *st, struct capture *c)
+{
+  char discard[RELAY_CHUNK];
+  for (;;) {
+    char *dst = discard;
+    size_t room = sizeof discard;
+    ssize_t n;
+    if (c->len == c->size && (!st->max_output || c->size < st->max_output)) {
+      /* grow geometrically, so the whole output costs O(log n) copies */
+      size_t size = c->size ? 2 * c->size : RELAY_CHUNK;
+      char *buf;
+      if (st->max_output && size > st->max_output) size = st->max_output;
+      buf = realloc(c->buf, size);
+      if (!buf) return -1;
+      c->buf = buf;
+      c->size = size;
+    }
+    if (c->len < c->size) {
+      dst = c->buf + c->len;
+      room = c->size - c->len;
+    }
+    do n = read(c->fd, dst, room);
+    while (n == -1 && errno == EINTR);
+    if (n == -1 && errno == EAGAIN) return 0;
+    if (n == -1) return -1;
+    if (n == 0) {
+      close_fd(&c->fd);
+      return 0;
+    }
+    if (dst == discard) st->truncated = 1;
+    else c->len += n;
+  }
+}
+
+/* Handles the events reported for fd: an input whose reader is gone or an
+ * output hung up with nothing left to read is closed without a syscall */
+static int run_handle(struct run_state *st, int fd, int revents)
+{
+  int i;
+  if (revents & POLLNVAL) {
+    errno = EBADF;
+    return -1;
+  }
+  if (fd == st->in_fd) {
+    if (revents & POLLERR) close_fd(&st->in_fd);
+    else return run_write(st);
+  }
+  for (i = 0; i < 2; i++)
+    if (fd == st->out[i].fd) {
+      if (revents & POLLIN) return run_read(st, &st->out[i]);
+      close_fd(&st->out[i].fd);
+    }
+  return 0;
+}
+
+/* Fills pfd with the descriptors still to be served, returns their number */
+static int run_pollfds(struct run_state *st, struct pollfd *pfd)
+{
+  int i, n = 0;
+  if (st->in_fd != -1) {
+    pfd[n].fd = st->in_fd;
+    pfd[n++].events = POLLOUT;
+  }
+  for (i = 0; i < 2; i++)
+    if (st->out[i].fd != -1) {
+      pfd[n].fd = st->out[i].fd;
+      pfd[n++].events = POLLIN;
+    }
+  return n;
+}
+
+static void run_free(struct run_state *st)
+{
+  close_fd(&st->in_fd);
+  close_fd(&st->out[0].fd);
+  close_fd(&st->out[1].fd);
+  free(st->out[0].buf);
+  free(st->out[1].buf);
+  st->out[0].buf = st->out[1].buf = 0;
+}
+
+/* Feeds and drains the child until all the pipes are closed */
+/* A child that does not read its input must not kill us with SIGPIPE: it is
+ * blocked while writing to children, and any instance raised meanwhile is
+ * consumed before restoring the mask. */
+struct sigpipe_guard {
+  sigset_t old_set;
+  int was_pending;
+};
+
+static void sigpipe_block(struct sigpipe_guard *g)
+{
+  sigset_t pipe_set, pending;
+  sigemptyset(&pipe_set);
+  sigaddset(&pipe_set, SIGPIPE);
+  sigpending(&pending);
+  g->was_pending = sigismember(&pending, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &pipe_set, &g->old_set);
+}
+
+static void sigpipe_restore(struct sigpipe_guard *g)
+{
+  sigset_t pipe_set, pending;
+  int sig;
+  sigemptyset(&pipe_set);
+  sigaddset(&pipe_set, SIGPIPE);
+  if (!g->was_pending) {
+    sigpending(&pending);
+    if (sigismember(&pending, SIGPIPE)) sigwait(&pipe_set, &sig);
+  }
+  pthread_sigmask(SIG_SETMASK, &g->old_set, 0);
+}
+
+#ifdef HAVE_IO_URING
+/* A minimal io_uring driven through the raw system calls: lc.run queues a
+ * read on every captured output and a write of the input, each linked after
+ * a poll of its pipe, and one io_uring_enter submits them and reaps what
+ * completed, instead of a poll and a read or write per chunk. The pipes stay
+ * non-blocking so that no operation ever sleeps in a kernel worker, where a
+ * cancellation could not stop it. */
+
+#define URING_ENTRIES 16
+#define URING_POLL 4                    /* user_data of the poll of pipe i */
+#define URING_CANCEL 8                  /* user_data of cancellations */
+
+struct uring {
+  int fd;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  unsigned tail, queued;                /* sqes filled, not submitted yet */
+};
+
+static struct uring run_ring = { -1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+static pthread_mutex_t run_ring_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int uring_setup(struct uring *r)
+{
+  struct io_uring_params params;
+  size_t sq_len, cq_len;
+  char *sq, *cq;
+  void *sqes;
+  int fd;
+  memset(&params, 0, sizeof params);
+  fd = (int)syscall(SYS_io_uring_setup, URING_ENTRIES, &params);
+  if (fd == -1) return -1;
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+  if (!(params.features & IORING_FEAT_RW_CUR_POS)) {
+    close(fd);
+    errno = ENOSYS;
+    return -1;
+  }
+  sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP && cq_len > sq_len)
+    sq_len = cq_len;
+  sq = mmap(0, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            fd, IORING_OFF_SQ_RING);
+  cq = sq;
+  if (sq != MAP_FAILED && !(params.features & IORING_FEAT_SINGLE_MMAP))
+    cq = mmap(0, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+              fd, IORING_OFF_CQ_RING);
+  sqes = sq == MAP_FAILED || cq == MAP_FAILED ? MAP_FAILED
+         : mmap(0, params.sq_entries * sizeof(struct io_uring_sqe),
+                PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                fd, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) {
+    int en = errno;
+    close(fd);                          /* the ring is only used once set up */
+    errno = en;
+    return -1;
+  }
+  r->fd = fd;
+  r->sq_head = (unsigned *)(sq + params.sq_off.head);
+  r->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+  r->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+  r->sq_array = (unsigned *)(sq + params.sq_off.array);
+  r->cq_head = (unsigned *)(cq + params.cq_off.head);
+  r->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+  r->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+  r->sqes = sqes;
+  r->tail = *r->sq_tail;
+  r->queued = 0;
+  return 0;
+}
+
+/* Queues an operation, there is always room since at most 12 are pending:
+ * a poll and an operation per pipe, and two cancellations per pipe */
+static struct io_uring_sqe *uring_queue(struct uring *r, int op, int fd,
+                                        void *buf, size_t len,
+                                        unsigned long long data)
+{
+  unsigned i = r->tail & *r->sq_mask;
+  struct io_uring_sqe *sqe = &r->sqes[i];
+  memset(sqe, 0, sizeof *sqe);
+  sqe->opcode = op;
+  sqe->fd = fd;
+  sqe->addr = (unsigned long long)(size_t)buf;
+  sqe->len = len > UINT_MAX ? UINT_MAX : (unsigned)len;
+  if (op == IORING_OP_READ || op == IORING_OP_WRITE)
+    sqe->off = (unsigned long long)-1;  /* the current position, for pipes */
+  sqe->user_data = data;
+  r->sq_array[i] = i;
+  r->tail++;
+  r->queued++;
+  return sqe;
+}
+
+/* Queues a poll of fd that the next operation queued is linked after */
+static void uring_poll(struct uring *r, int fd, int events, int i)
+{
+  struct io_uring_sqe *sqe = uring_queue(r, IORING_OP_POLL_ADD, fd, 0, 0,
+                                         URING_POLL + i);
+  sqe->poll_events = events;
+  sqe->flags |= IOSQE_IO_LINK;
+}
+
+/* Submits what was queued and waits for at least one completion */
+static int uring_enter(struct uring *r)
+{
+  int n;
+  __atomic_store_n(r->sq_tail, r->tail, __ATOMIC_RELEASE);
+  n = (int)syscall(SYS_io_uring_enter, r->fd, r->queued, 1,
+                   IORING_ENTER_GETEVENTS, 0, 0);
+  if (n == -1) return errno == EINTR || errno == EAGAIN ? 0 : -1;
+  r->queued -= n;
+  return 0;
+}
+
+/* Takes the next completion, returns 0 when there is none */
+static int uring_reap(struct uring *r, unsigned long long *data, int *res)
+{
+  unsigned head = *r->cq_head;
+  struct io_uring_cqe *cqe;
+  if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) return 0;
+  cqe = &r->cqes[head & *r->cq_mask];
+  *data = cqe->user_data;
+  *res = cqe->res;
+  __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+/* Queues the next operation on the pipe i of st (0 for the input) */
+static int uring_run_queue(struct uring *r, struct run_state *st, int i,
+                           char **discard)
+{
+  struct capture *c;
+  if (i == 0) {
+    uring_poll(r, st->in_fd, POLLOUT, 0);
+    uring_queue(r, IORING_OP_WRITE, st->in_fd, (char *)st->input + st->input_pos,
+                st->input_len - st->input_pos, 0);
+    return 0;
+  }
+  c = &st->out[i - 1];
+  if (c->len == c->size && (!st->max_output || c->size < st->max_output)) {
+    size_t size = c->size ? 2 * c->size : RELAY_CHUNK;
+    char *buf;
+    if (st->max_output && size > st->max_output) size = st->max_output;
+    buf = realloc(c->buf, size);
+    if (!buf) return -1;
+    c->buf = buf;
+    c->size = size;
+  }
+  if (c->len < c->size) {
+    uring_poll(r, c->fd, POLLIN, i);
+    uring_queue(r, IORING_OP_READ, c->fd, c->buf + c->len, c->size - c->len, i);
+    return 0;
+  }
+  if (!*discard && !(*discard = malloc(RELAY_CHUNK))) return -1;
+  uring_poll(r, c->fd, POLLIN, i);
+  uring_queue(r, IORING_OP_READ, c->fd, *discard, RELAY_CHUNK, i);
+  return 0;
+}
+
+/* Handles the completion of the operation on the pipe i of st */
+static int uring_run_done(struct run_state *st, int i, int res)
+{
+  struct capture *c = i ? &st->out[i - 1] : 0;
+  /* cancelled with its poll, whose failure is reported on its own */
+  if (res == -EINTR || res == -EAGAIN || res == -ECANCELED) return 0;
+  if (i == 0) {
+    if (res < 0 && res != -EPIPE) goto error;
+    if (res > 0) st->input_pos += res;
+    if (res < 0 || st->input_pos == st->input_len)
+      close_fd(&st->in_fd);             /* done, or the child stopped reading */
+    return 0;
+  }
+  if (res < 0) goto error;
+  if (res == 0) close_fd(&c->fd);
+  else if (c->len < c->size) c->len += res;
+  else st->truncated = 1;
+  return 0;
+error:
+  errno = -res;
+  return -1;
+}
+
+/* run_loop through the ring, returns 1 when the ring is busy */
+static int uring_run_loop(struct run_state *st)
+{
+  struct uring *r = &run_ring;
+  struct sigpipe_guard guard;
+  char *discard = 0;
+  int i, inflight = 0, ret = 0, cancelled = 0;
+  if (0 != pthread_mutex_trylock(&run_ring_lock)) return 1;
+  sigpipe_block(&guard);
+  for (;;) {
+    unsigned long long data;
+    int res;
+    if (ret == 0)
+      for (i = 0; i < 3; i++) {
+        int fd = i ? st->out[i - 1].fd : st->in_fd;
+        if (fd != -1 && !(inflight & 1 << i)) {
+          if (-1 == uring_run_queue(r, st, i, &discard)) {
+            ret = -1;
+            break;
+          }
+          inflight |= 1 << i;
+        }
+      }
+    if (ret == -1 && !cancelled) {
+      /* the buffers must outlive the operations */
+      int en = errno;
+      for (i = 0; i < 3; i++)
+        if (inflight & 1 << i) {
+          uring_queue(r, IORING_OP_ASYNC_CANCEL, -1,
+                      (void *)(size_t)(URING_POLL + i), 0, URING_CANCEL);
+          uring_queue(r, IORING_OP_ASYNC_CANCEL, -1, (void *)(size_t)i, 0,
+                      URING_CANCEL);
+        }
+      cancelled = 1;
+      errno = en;
+    }
+    if (!inflight && !r->queued) break;
+    if (-1 == uring_enter(r)) {
+      /* nothing submitted: only the operations in flight remain */
+      if (ret == 0) ret = -1;
+      r->queued = 0;
+      r->tail = *r->sq_tail;
+      if (!inflight) break;
+      continue;
+    }
+    while (uring_reap(r, &data, &res)) {
+      if (data == URING_CANCEL) continue;
+      if (data >= URING_POLL) {
+        if (res < 0 && res != -ECANCELED && ret == 0) {
+          errno = -res;
+          ret = -1;
+        }
+        continue;
+      }
+      inflight &= ~(1 << data);
+      if (ret == 0) ret = uring_run_done(st, (int)data, res);
+    }
+  }
+  sigpipe_restore(&guard);
+  pthread_mutex_unlock(&run_ring_lock);
+  free(discard);
+  return ret;
+}
+#endif
+
+static const char *const run_engines[] = {
+#ifdef HAVE_IO_URING
+  "io_uring",
+#endif
+  "poll", 0
+};
+
+/* Index in run_engines of the engine of lc.run, -1 until chosen */
+static int run_engine = -1;
+static pthread_mutex_t run_engine_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Selects the engine named, returns -1 if it is not usable here. Called with
+ * run_engine_lock held. */
+static int run_engine_select(const char *name)
+{
+  int i;
+  for (i = 0; run_engines[i] && strcmp(run_engines[i], name); i++) ;
+  if (!run_engines[i]) return -1;
+#ifdef HAVE_IO_URING
+  if (!strcmp(name, "io_uring")) {
+    pthread_mutex_lock(&run_ring_lock);
+    if (run_ring.fd == -1 && -1 == uring_setup(&run_ring)) i = -1;
+    pthread_mutex_unlock(&run_ring_lock);
+    if (i == -1) return -1;
+  }
+#endif
+  run_engine = i;
+  return 0;
+}
+
+/* Selects the engine named if any, returns the engine in use or -1 if the
+ * one named is not usable here */
+static int run_engine_get(const char *name)
+{
+  int i;
+  pthread_mutex_lock(&run_engine_lock);
+  if (run_engine == -1 && -1 == run_engine_select(run_engines[0]))
+    run_engine_select("poll");
+  i = name && -1 == run_engine_select(name) ? -1 : run_engine;
+  pthread_mutex_unlock(&run_engine_lock);
+  return i;
+}
+
+/* [name] -- name/nil error */
+int lc_engine(lua_State *L)
+{
+  const char *name = luaL_optstring(L, 1, 0);
+  int i = run_engine_get(name);
+  if (i == -1) {
+    lua_pushnil(L);
+    lua_pushfstring(L, "I/O engine '%s' not available", name);
+    return 2;
+  }
+  lua_pushstring(L, run_engines[i]);
+  return 1;
+}
+
+static int run_loop(struct run_state *st)
+{
+  struct pollfd pfd[3];
+  struct sigpipe_guard guard;
+  int i, n, ret = 0;
+#ifdef HAVE_IO_URING
+  if (run_engine_get(0) == 0 && 1 != (ret = uring_run_loop(st)))
+    return ret;
+  ret = 0;                              /* busy in another thread */
+#endif
+  sigpipe_block(&guard);
+  while (ret == 0 && 0 < (n = run_pollfds(st, pfd))) {
+    if (-1 == poll(pfd, n, -1)) {
+      if (errno != EINTR) ret = -1;
+      continue;
+    }
+    for (i = 0; ret == 0 && i < n; i++)
+      if (pfd[i].revents)
+        ret = run_handle(st, pfd[i].fd, pfd[i].revents);
+  }
+  sigpipe_restore(&guard);
+  return ret;
+}
+
+/* ... proc -- ... result */
+static void run_push(lua_State *L, struct run_state *st, struct process *p,
+                     const int capture[2])
+{
+  static const char *const names[] = { "stdout", "stderr" };
+  int i;
+  lua_newtable(L);
+  push_result_fields(L, p);
+  for (i = 0; i < 2; i++)
+    if (capture[i]) {
+      lua_pushlstring(L, st->out[i].buf, st->out[i].len);
+      lua_setfield(L, -2, names[i]);
+    }
+  if (st->truncated) {
+    lua_pushboolean(L, 1);
+    lua_setfield(L, -2, "truncated");
+  }
+  lua_replace(L, -2);
+}
+
+/* Reads the input, capture and max_output options of lc_run */
+static void run_options(lua_State *L, struct run_state *st, int capture[2])
+{
+  capture[0] = capture[1] = 0;
+  if (!lua_istable(L, 2)) {
+    capture[0] = capture[1] = 1;
+    return;
+  }
+  lua_getfield(L, 2, "input");          /* stays on the stack */
+  if (!lua_isnil(L, -1)) {
+    st->input = luaL_checklstring(L, -1, &st->input_len);
+    lua_getfield(L, 2, "stdin");
+    if (!lua_isnil(L, -1))
+      luaL_error(L, "cannot specify both the input and stdin options");
+    lua_pop(L, 1);
+  }
+  lua_getfield(L, 2, "max_output");
+  if (!lua_isnil(L, -1)) {
+    lua_Number n = lua_tonumber(L, -1);
+    if (lua_type(L, -1) != LUA_TNUMBER || !(n >= 0 && n < (lua_Number)SIZE_MAX)
+        || n != (lua_Number)(size_t)n)
+      luaL_error(L, "bad max_output option (non-negative integer expected)");
+    st->max_output = (size_t)n;
+  }
+  lua_pop(L, 1);
+  lua_getfield(L, 2, "capture");
+  if (lua_istable(L, -1)) {
+    size_t i, n = lua_value_length(L, -1);
+    for (i = 1; i <= n; i++) {
+      const char *name;
+      lua_rawgeti(L, -1, i);
+      name = lua_tostring(L, -1);
+      if (name && !strcmp(name, "stdout")) capture[0] = 1;
+      else if (name && !strcmp(name, "stderr")) capture[1] = 1;
+      else luaL_error(L, "bad capture option (\"stdout\" or \"stderr\" expected)");
+      lua_pop(L, 1);
+    }
+  }
+  else {
+    /* by default, capture what is not redirected elsewhere */
+    lua_getfield(L, 2, "stdout");
+    capture[0] = lua_isnil(L, -1);
+    lua_getfield(L, 2, "stderr");
+    capture[1] = lua_isnil(L, -1);
+    lua_pop(L, 2);
+  }
+  lua_pop(L, 1);
+}
+
+/* Spawns the child of lc_run with pipes for its input and captured outputs,
+ * left non-blocking in st */
+/* filename [args-opts] -- proc/nil error */
+/* args-opts -- proc/nil error */
+static int run_spawn(lua_State *L, struct run_state *st, int capture[2])
+{
+  struct spawn_params *params = spawn_prepare(L);
+  int child[3] = { -1, -1, -1 };
+  int i, fd[2], ret;
+  if (!params) return 0;
+  run_init(st);
+  run_options(L, st, capture);
+  if (st->input) {
+    if (-1 == open_pipe(L, 0, fd)) return push_error(L);
+    child[0] = fd[0];
+    st->in_fd = fd[1];
+    spawn_param_redirect(params, "stdin", fd[0]);
+  }
+  for (i = 0; i < 2; i++)
+    if (capture[i]) {
+      if (-1 == open_pipe(L, 0, fd)) {
+        int en = errno;
+        run_free(st);
+        close_fd(&child[0]);
+        close_fd(&child[1]);
+        errno = en;
+        return push_error(L);
+      }
+      st->out[i].fd = fd[0];
+      child[i + 1] = fd[1];
+      spawn_param_redirect(params, i ? "stderr" : "stdout", fd[1]);
+    }
+  ret = spawn_param_execute(params);    /* ... proc/nil error */
+  for (i = 0; i < 3; i++)
+    close_fd(&child[i]);
+  if (ret != 1) {
+    run_free(st);
+    return ret;
+  }
+  if (st->in_fd != -1) set_nonblock(st->in_fd);
+  for (i = 0; i < 2; i++)
+    if (st->out[i].fd != -1) set_nonblock(st->out[i].fd);
+  return 1;
+}
+
+/* run_state -- */
+int run_state_gc(lua_State *L)
+{
+  run_free(luaL_checkudata(L, 1, RUN_STATE_HANDLE));
+  return 0;
+}
+
+/* filename [args-opts] -- result/nil error */
+/* args-opts -- result/nil error */
+int lc_run(lua_State *L)
+{
+  struct run_state *st;
+  struct process *proc;
+  int capture[2], ret;
+  /* the state is collected with its pipes and buffers if anything raises */
+  lua_settop(L, 2);
+  st = lua_newuserdata(L, sizeof *st);  /* filename args-opts st */
+  run_init(st);
+  luaL_getmetatable(L, RUN_STATE_HANDLE);
+  lua_setmetatable(L, -2);
+  ret = run_spawn(L, st, capture);
+  if (ret != 1) return ret;
+  proc = lua_touserdata(L, -1);
+  ret = run_loop(st);
+  if (ret == -1) {
+    int en = errno;
+    run_free(st);
+    process_update(proc, -1);
+    errno = en;
+    return push_error(L);
+  }
+  if (-1 == process_update(proc, -1)) {
+    run_free(st);
+    return push_error(L);
+  }
+  run_push(L, st, proc, capture);       /* ... result */
+  run_free(st);
+  return 1;
+}
+
+/* A pool of long-lived workers fed over their standard streams. A request
+ * and its response are both sent as their length in decimal, a newline,
+ * then as many bytes. The uservalue of the pool keeps the worker command,
+ * the worker processes, the payloads of the requests not answered yet, the
+ * results not collected yet and the order they came in. */
+
+enum { POOL_CMD = 1, POOL_PROCS, POOL_PENDING, POOL_RESULTS, POOL_ORDER };
+
+#define POOL_HEADER 24
+#define POOL_KILL_TIMEOUT 1000          /* ms from SIGTERM to SIGKILL */
+
+struct pool_worker {
+  int in, out;                          /* its stdin and stdout, -1 if dead */
+  lua_Number id;                        /* request being served, or 0 */
+  int retried;                          /* it already had a worker die */
+  const char *req;                      /* payload, kept alive by pending */
+  size_t req_len, req_pos;              /* req_pos counts the header too */
+  char hdr[POOL_HEADER];
+  size_t hdr_len;
+  char *resp;                           /* header and payload received */
+  size_t resp_len, resp_size;
+};
+
+struct pool {
+  int size, closed;
+  int inflight;                         /* requests submitted, not completed */
+  lua_Number next_id, next_dispatch;    /* requests below are dispatched */
+  lua_Number order_head, order_tail;
+  struct pool_worker w[1];
+};
+
+/* Stores the value on top of the stack at key in a table of the uservalue */
+/* ... value -- ... */
+static void pool_set(lua_State *L, int uv, int slot, lua_Number key)
+{
+  lua_rawgeti(L, uv, slot);
+  lua_pushnumber(L, key);
+  lua_pushvalue(L, -3);
+  lua_rawset(L, -3);
+  lua_pop(L, 2);
+}
+
+/* ... -- ... value */
+static void pool_get(lua_State *L, int uv, int slot, lua_Number key)
+{
+  lua_rawgeti(L, uv, slot);
+  lua_pushnumber(L, key);
+  lua_rawget(L, -2);
+  lua_replace(L, -2);
+}
+
+/* Records the result of the request served by worker w: the response, or
+ * nil and an error message */
+/* ... response/nil [error] -- ... */
+static void pool_complete(lua_State *L, struct pool *pl, int uv,
+                          struct pool_worker *w, int nresults)
+{
+  int i;
+  lua_createtable(L, 2, 0);
+  lua_insert(L, -1 - nresults);         /* ... result response/nil [error] */
+  for (i = nresults; i > 0; i--)
+    lua_rawseti(L, -1 - i, i);
+  pool_set(L, uv, POOL_RESULTS, w->id);
+  lua_pushnumber(L, w->id);
+  pool_set(L, uv, POOL_ORDER, pl->order_tail++);
+  lua_pushnil(L);
+  pool_set(L, uv, POOL_PENDING, w->id);
+  pl->inflight--;
+  w->id = 0;
+  w->req = 0;
+  w->resp_len = 0;
+}
+
+/* stage in out err -- proc/nil error */
+static int spawn_stage(lua_State *L);
+
+/* Starts worker i, returning 0 or -1 with errno or an error message pushed */
+static int pool_start(lua_State *L, struct pool *pl, int uv, int i)
+{
+  struct pool_worker *w = &pl->w[i];
+  int to[2], from[2];
+  if (-1 == open_pipe(L, 0, to)) return -1;
+  if (-1 == open_pipe(L, 0, from)) {
+    int en = errno;
+    close(to[0]);
+    close(to[1]);
+    errno = en;
+    return -1;
+  }
+  lua_pushcfunction(L, spawn_stage);
+  lua_rawgeti(L, uv, POOL_CMD);
+  lua_pushnumber(L, to[0]);
+  lua_pushnumber(L, from[1]);
+  lua_pushnil(L);
+  if (0 != lua_pcall(L, 4, 2, 0) || lua_isnil(L, -2)) {
+    close(to[0]);
+    close(to[1]);
+    close(from[0]);
+    close(from[1]);
+    if (lua_isnil(L, -2)) lua_replace(L, -2);   /* error */
+    errno = 0;
+    return -1;
+  }
+  lua_pop(L, 1);                        /* proc */
+  lua_rawgeti(L, uv, POOL_PROCS);
+  lua_insert(L, -2);
+  lua_rawseti(L, -2, i + 1);
+  lua_pop(L, 1);
+  close(to[0]);
+  close(from[1]);
+  set_nonblock(to[1]);
+  set_nonblock(from[0]);
+  w->in = to[1];
+  w->out = from[0];
+  w->id = 0;
+  w->resp_len = 0;
+  return 0;
+}
+
+/* Closes the streams of worker i and reaps it, failing its request. A
+ * killed worker gets SIGTERM, then SIGKILL if it is still there after
+ * POOL_KILL_TIMEOUT. */
+static void pool_stop(lua_State *L, struct pool *pl, int uv, int i, int kill)
+{
+  struct pool_worker *w = &pl->w[i];
+  struct process *p;
+  close_fd(&w->in);
+  close_fd(&w->out);
+  pool_get(L, uv, POOL_PROCS, i + 1);
+  p = test_udata(L, -1, PROCESS_HANDLE);
+  if (p) {
+    if (kill) {
+      _process_terminate(p);
+      if (0 == process_update(p, POOL_KILL_TIMEOUT))
+        process_signal(p, SIGKILL, 0);
+    }
+    process_update(p, -1);
+  }
+  if (w->id) {
+    lua_pushnil(L);
+    if (p) lua_pushfstring(L, "worker exited with code %d", p->status);
+    else lua_pushliteral(L, "worker exited");
+    pool_complete(L, pl, uv, w, 2);
+  }
+  lua_pop(L, 1);
+}
+
+/* Replaces a worker that died or broke the protocol */
+static int pool_restart(lua_State *L, struct pool *pl, int uv, int i)
+{
+  pool_stop(L, pl, uv, i, 1);
+  return pool_start(L, pl, uv, i);
+}
+
+/* Replaces a worker that died before answering anything, handing its request
+ * to the new worker once: it may have died before even reading it. A second
+ * death fails the request. */
+static int pool_retry(lua_State *L, struct pool *pl, int uv, int i)
+{
+  struct pool_worker *w = &pl->w[i];
+  lua_Number id = w->id;
+  if (!id || w->retried || w->resp_len) return pool_restart(L, pl, uv, i);
+  w->id = 0;                            /* not failed by pool_stop */
+  if (-1 == pool_restart(L, pl, uv, i)) {
+    w->id = id;                         /* no worker to retry on */
+    lua_pushnil(L);
+    lua_pushliteral(L, "worker exited");
+    pool_complete(L, pl, uv, w, 2);
+    return -1;
+  }
+  w->id = id;
+  w->retried = 1;
+  w->req_pos = 0;
+  return 0;
+}
+
+/* Hands the oldest waiting requests to the idle workers. An idle worker has
+ * nothing to say: when its output is readable, it died or misbehaved and is
+ * restarted before it gets the request. Returns -1 like pool_start. */
+static int pool_dispatch(lua_State *L, struct pool *pl, int uv)
+{
+  int i;
+  for (i = 0; i < pl->size && pl->next_dispatch < pl->next_id; i++) {
+    struct pool_worker *w = &pl->w[i];
+    if (w->id || w->in == -1) continue;
+    if (0 != poll_fd(w->out, POLLIN, 0) && -1 == pool_restart(L, pl, uv, i))
+      return -1;
+    w->id = pl->next_dispatch++;
+    w->retried = 0;
+    pool_get(L, uv, POOL_PENDING, w->id);
+    w->req = lua_tolstring(L, -1, &w->req_len);
+    lua_pop(L, 1);
+    w->hdr_len = sprintf(w->hdr, "%lu\n", (unsigned long)w->req_len);
+    w->req_pos = 0;
+    w->resp_len = 0;
+  }
+  return 0;
+}
+
+/* Writes what it can of the request of w. Returns -1 if the worker died. */
+static int pool_write(struct pool_worker *w)
+{
+  while (w->req_pos < w->hdr_len + w->req_len) {
+    const char *src = w->req_pos < w->hdr_len ? w->hdr + w->req_pos
+                      : w->req + (w->req_pos - w->hdr_len);
+    size_t len = w->req_pos < w->hdr_len ? w->hdr_len - w->req_pos
+                 : w->req_len - (w->req_pos - w->hdr_len);
+    ssize_t n;
+    do n = write(w->in, src, len); while (n == -1 && errno == EINTR);
+    if (n == -1) return errno == EAGAIN ? 0 : -1;
+    w->req_pos += n;
+  }
+  return 0;
+}
+
+/* Parses the header of the response of w, decimal digits and a newline.
+ * Returns 1 with the payload offset and length, 0 when more is needed and
+ * -1 when it is garbage. */
+static int pool_header(const struct pool_worker *w, size_t *off, size_t *len)
+{
+  size_t max = w->resp_len < POOL_HEADER ? w->resp_len : POOL_HEADER;
+  const char *nl = memchr(w->resp, '\n', max);
+  char *end;
+  unsigned long n;
+  if (!nl) return w->resp_len >= POOL_HEADER ? -1 : 0;
+  if (w->resp[0] < '0' || w->resp[0] > '9') return -1;
+  errno = 0;
+  n = strtoul(w->resp, &end, 10);
+  if (end != nl || errno == ERANGE) return -1;
+  *off = nl - w->resp + 1;
+  *len = n;
+  return 1;
+}
+
+/* Reads what it can of the response of w. Returns 1 when it is complete,
+ * 0 when more is needed and -1 if the worker died or misbehaved. */
+static int pool_read(struct pool_worker *w)
+{
+  for (;;) {
+    size_t off, len;
+    int ret;
+    ssize_t n;
+    if (w->resp_len == w->resp_size) {
+      size_t size = w->resp_size ? 2 * w->resp_size : 256;
+      char *buf = realloc(w->resp, size);
+      if (!buf) return -1;
+      w->resp = buf;
+      w->resp_size = size;
+    }
+    do n = read(w->out, w->resp + w->resp_len, w->resp_size - w->resp_len);
+    while (n == -1 && errno == EINTR);
+    if (n == -1 && errno == EAGAIN) return 0;
+    if (n <= 0) return -1;
+    w->resp_len += n;
+    ret = pool_header(w, &off, &len);
+    if (ret == -1) return -1;
+    if (ret == 1 && w->resp_len - off >= len) return 1;
+  }
+}
+
+/* Serves the workers until a request completes or timeout milliseconds
+ * passed (-1 forever). Returns 1 on completion, 0 on timeout or when nothing
+ * is in progress, -1 on error with errno set or a message pushed. */
+static int pool_pump(lua_State *L, struct pool *pl, int uv, int timeout)
+{
+  struct pollfd *pfd = lua_newuserdata(L, 2 * pl->size * sizeof *pfd);
+  int pfd_idx = lua_gettop(L);
+  struct sigpipe_guard guard;
+  struct timespec start, now;
+  int i, n, ret = 0;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  sigpipe_block(&guard);
+  while (ret == 0) {
+    int wait = timeout;
+    if (-1 == pool_dispatch(L, pl, uv)) {
+      ret = -1;
+      break;
+    }
+    for (i = n = 0; i < pl->size; i++) {
+      struct pool_worker *w = &pl->w[i];
+      if (!w->id) continue;
+      pfd[n].fd = w->out;
+      pfd[n++].events = POLLIN;
+      if (w->req_pos < w->hdr_len + w->req_len) {
+        pfd[n].fd = w->in;
+        pfd[n++].events = POLLOUT;
+      }
+    }
+    if (n == 0) break;
+    if (timeout > 0) {
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      wait = timeout - (int)((now.tv_sec - start.tv_sec) * 1000
+                             + (now.tv_nsec - start.tv_nsec) / 1000000);
+      if (wait < 0) wait = 0;
+    }
+    i = poll(pfd, n, wait);
+    if (i == -1 && errno == EINTR) continue;
+    if (i == -1) {
+      ret = -1;
+      break;
+    }
+    if (i == 0) break;
+    for (i = 0; i < pl->size; i++) {
+      struct pool_worker *w = &pl->w[i];
+      int j, r = 0, events = 0;
+      for (j = 0; j < n; j++)
+        if (pfd[j].revents && (pfd[j].fd == w->in || pfd[j].fd == w->out))
+          events |= pfd[j].fd == w->in ? POLLOUT : POLLIN;
+      if (!w->id || !events) continue;
+      if (events & POLLOUT) r = pool_write(w);
+      if (r == 0 && events & POLLIN) r = pool_read(w);
+      if (r == 1) {
+        size_t off, len;
+        pool_header(w, &off, &len);
+        lua_pushlstring(L, w->resp + off, len);
+        pool_complete(L, pl, uv, w, 1);
+        ret = 1;
+      }
+      else if (r == -1) {
+        int retry = w->id && !w->retried && !w->resp_len;
+        if (-1 == pool_retry(L, pl, uv, i)) {
+          ret = -1;
+          break;
+        }
+        if (!retry) ret = 1;            /* its request failed */
+      }
+    }
+  }
+  sigpipe_restore(&guard);
+  lua_remove(L, pfd_idx);
+  return ret;
+}
+
+static int pool_error(lua_State *L)
+{
+  if (errno) return push_error(L);
+  lua_pushnil(L);
+  lua_insert(L, -2);
+  return 2;
+}
+
+/* {cmd=args-opts, size=n} -- pool/nil error */
+int lc_pool(lua_State *L)
+{
+  struct pool *pl;
+  int i, n;
+  luaL_checktype(L, 1, LUA_TTABLE);
+  lua_settop(L, 1);
+  lua_getfield(L, 1, "size");
+  n = lua_isnil(L, -1) ? 1 : (int)luaL_checknumber(L, -1);
+  if (n < 1) return luaL_error(L, "bad size option (positive number expected)");
+  lua_getfield(L, 1, "cmd");            /* opts size cmd */
+  luaL_checktype(L, -1, LUA_TTABLE);
+  pl = lua_newuserdata(L, sizeof *pl + (n - 1) * sizeof pl->w[0]);
+  memset(pl, 0, sizeof *pl + (n - 1) * sizeof pl->w[0]);
+  pl->size = n;
+  pl->next_id = pl->next_dispatch = 1;
+  for (i = 0; i < n; i++) pl->w[i].in = pl->w[i].out = -1;
+  luaL_getmetatable(L, POOL_HANDLE);
+  lua_setmetatable(L, -2);              /* opts size cmd pool */
+  lua_createtable(L, POOL_ORDER, 0);
+  lua_pushvalue(L, 3);
+  lua_rawseti(L, -2, POOL_CMD);
+  for (i = POOL_PROCS; i <= POOL_ORDER; i++) {
+    lua_newtable(L);
+    lua_rawseti(L, -2, i);
+  }
+  lua_pushvalue(L, -1);
+  lua_setuserdatatable(L, 4);           /* opts size cmd pool uv */
+  for (i = 0; i < n; i++)
+    if (-1 == pool_start(L, pl, 5, i)) return pool_error(L);
+  lua_pop(L, 1);
+  return 1;
+}
+
+static struct pool *check_pool(lua_State *L)
+{
+  struct pool *pl = luaL_checkudata(L, 1, POOL_HANDLE);
+  if (pl->closed) luaL_error(L, "attempt to use a closed pool");
+  return pl;
+}
+
+/* pool payload -- id */
+int pool_submit(lua_State *L)
+{
+  struct pool *pl = check_pool(L);
+  luaL_checkstring(L, 2);
+  lua_settop(L, 2);
+  lua_getuserdatatable(L, 1);           /* pool payload uv */
+  lua_pushvalue(L, 2);
+  pool_set(L, 3, POOL_PENDING, pl->next_id);
+  pl->inflight++;
+  lua_pushnumber(L, pl->next_id++);
+  return 1;
+}
+
+/* Pushes the result of request id if it completed, removing it */
+/* pool ... uv -- pool ... uv [response/nil error] */
+static int pool_take(lua_State *L, int uv, lua_Number id)
+{
+  pool_get(L, uv, POOL_RESULTS, id);
+  if (lua_isnil(L, -1)) {
+    lua_pop(L, 1);
+    return 0;
+  }
+  lua_pushnil(L);
+  pool_set(L, uv, POOL_RESULTS, id);
+  lua_rawgeti(L, -1, 1);
+  if (!lua_isnil(L, -1)) {
+    lua_remove(L, -2);
+    return 1;
+  }
+  lua_rawgeti(L, -2, 2);
+  lua_remove(L, -3);
+  return 2;
+}
+
+/* pool [timeout] -- id response/id nil error/true timeout/nil error */
+int pool_collect(lua_State *L)
+{
+  struct pool *pl = check_pool(L);
+  int n, timeout = opt_timeout(L, 2, -1);
+  lua_settop(L, 1);
+  lua_getuserdatatable(L, 1);           /* pool uv */
+  for (;;) {
+    while (pl->order_head < pl->order_tail) {
+      lua_Number id;
+      pool_get(L, 2, POOL_ORDER, pl->order_head);
+      id = lua_tonumber(L, -1);
+      lua_pop(L, 1);
+      lua_pushnil(L);
+      pool_set(L, 2, POOL_ORDER, pl->order_head++);
+      if ((n = pool_take(L, 2, id))) {  /* not taken by pool_call */
+        lua_pushnumber(L, id);
+        lua_insert(L, -1 - n);
+        return n + 1;
+      }
+    }
+    if (pl->inflight == 0) {
+      lua_pushnil(L);
+      lua_pushliteral(L, "no pending request");
+      return 2;
+    }
+    switch (pool_pump(L, pl, 2, timeout)) {
+    case -1: return pool_error(L);
+    case 0:
+      lua_pushboolean(L, 1);
+      return 1;
+    }
+  }
+}
+
+/* pool payload -- response/nil error */
+int pool_call(lua_State *L)
+{
+  struct pool *pl = check_pool(L);
+  lua_Number id;
+  int n;
+  pool_submit(L);
+  id = lua_tonumber(L, -1);
+  lua_settop(L, 1);
+  lua_getuserdatatable(L, 1);           /* pool uv */
+  while (!(n = pool_take(L, 2, id))) {
+    switch (pool_pump(L, pl, 2, -1)) {
+    case -1: return pool_error(L);
+    case 0:
+      lua_pushnil(L);
+      lua_pushliteral(L, "no worker available");
+      return 2;
+    }
+  }
+  return n;
+}
+
+/* Closes the streams of the workers and hands them over to the registry,
+ * terminated: the collector must not wait for them */
+/* pool -- */
+int pool_gc(lua_State *L)
+{
+  struct pool *pl = luaL_checkudata(L, 1, POOL_HANDLE);
+  int i;
+  if (pl->closed) return 0;
+  pl->closed = 1;
+  lua_settop(L, 1);
+  lua_getuserdatatable(L, 1);
+  lua_rawgeti(L, 2, POOL_PROCS);
+  for (i = 0; i < pl->size; i++) {
+    struct process *p;
+    close_fd(&pl->w[i].in);
+    close_fd(&pl->w[i].out);
+    free(pl->w[i].resp);
+    pl->w[i].resp = 0;
+    lua_rawgeti(L, 3, i + 1);
+    p = test_udata(L, -1, PROCESS_HANDLE);
+    if (p) process_release(p);
+    lua_pop(L, 1);
+  }
+  return 0;
+}
+
+/* Closes the streams of the workers, so they end, and waits for them */
+/* pool -- true */
+int pool_close(lua_State *L)
+{
+  struct pool *pl = luaL_checkudata(L, 1, POOL_HANDLE);
+  int i;
+  if (pl->closed) return 0;
+  pl->closed = 1;
+  lua_settop(L, 1);
+  lua_getuserdatatable(L, 1);
+  for (i = 0; i < pl->size; i++) {
+    pool_stop(L, pl, 2, i, 0);
+    free(pl->w[i].resp);
+    pl->w[i].resp = 0;
+  }
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+/* Fork server: a helper forked early, before the parent grew threads and a
+ * big heap, that forks the children asked over a socket. Requests carry the
+ * standard streams of the child as SCM_RIGHTS descriptors and a payload of
+ * strings, each a native unsigned length, the bytes and a terminating zero:
+ * the argv of a command or a Lua chunk followed by its arguments. Signals
+ * are sent by the helper too, which knows whether it reaped the child. */
+
+#ifdef MSG_NOSIGNAL
+#define FS_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define FS_SEND_FLAGS 0
+#endif
+
+struct fs_request {
+  int kind;                             /* 'X' exec argv, 'L' run Lua chunk,
+                                           'K' signal a child */
+  int mask;                             /* standard streams passed along */
+  unsigned count;                       /* strings in the payload */
+  unsigned len;                         /* payload bytes */
+  int pid, sig;                         /* child and signal for 'K' */
+};
+
+struct fs_reply {
+  int kind;                             /* 'R' ready, 'S' spawned, 'E' exited,
+                                           'K' signaled */
+  int pid;                              /* -1 if the fork failed */
+  int value;                            /* errno for 'S' and 'K', wait status
+                                           for 'E' */
+};
+
+struct forkserver {
+  int sock;
+  pid_t pid;
+};
+
+struct forkchild {
+  pid_t pid;
+  int status, signal, core;             /* status is -1 while running */
+};
+
+/* Reads exactly len bytes, returns 1 when done, 0 at end of file, -1 on error */
+static int read_all(int fd, char *buf, size_t len)
+{
+  while (len > 0) {
+    ssize_t n = read(fd, buf, len);
+    if (n == -1 && errno == EINTR) continue;
+    if (n <= 0) return (int)n;
+    buf += n;
+    len -= n;
+  }
+  return 1;
+}
+
+/* Like write_all, without raising SIGPIPE when the other end is gone */
+static int send_all(int sock, const char *buf, size_t len)
+{
+  while (len > 0) {
+    ssize_t n = send(sock, buf, len, FS_SEND_FLAGS);
+    if (n == -1 && errno == EINTR) continue;
+    if (n == -1) return -1;
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static int fs_send_request(int sock, const struct fs_request *rq,
+                           const int *fds, int nfds, const char *payload)
+{
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(3 * sizeof(int))];
+  } cm;
+  struct msghdr msg;
+  struct iovec iov;
+  ssize_t n;
+  memset(&msg, 0, sizeof msg);
+  iov.iov_base = (void *)rq;
+  iov.iov_len = sizeof *rq;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if (nfds) {
+    struct cmsghdr *c;
+    memset(&cm, 0, sizeof cm);
+    msg.msg_control = cm.buf;
+    msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+    c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+    memcpy(CMSG_DATA(c), fds, nfds * sizeof(int));
+  }
+  do n = sendmsg(sock, &msg, FS_SEND_FLAGS); while (n == -1 && errno == EINTR);
+  if (n == -1) return -1;
+  if (-1 == send_all(sock, (const char *)rq + n, sizeof *rq - n)) return -1;
+  return send_all(sock, payload, rq->len);
+}
+
+/* Returns 1 with the request header and its descriptors, 0 at end of file,
+ * -1 on error. Descriptors that do not match the mask of the request, or
+ * were cut off, fail it with EMSGSIZE after the header was read in full,
+ * so that the stream stays in step. */
+static int fs_recv_request(int sock, struct fs_request *rq, int *fds, int *nfds)
+{
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(3 * sizeof(int))];
+  } cm;
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *c;
+  ssize_t n;
+  int i, ret, bad;
+  memset(&msg, 0, sizeof msg);
+  iov.iov_base = rq;
+  iov.iov_len = sizeof *rq;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cm.buf;
+  msg.msg_controllen = sizeof cm.buf;
+  do n = recvmsg(sock, &msg, 0); while (n == -1 && errno == EINTR);
+  if (n <= 0) return (int)n;
+  *nfds = 0;
+  bad = (msg.msg_flags & MSG_CTRUNC) != 0;
+  for (c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+    if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+      int count = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      if (*nfds + count > 3) {
+        bad = 1;
+        count = 3 - *nfds;
+      }
+      memcpy(fds + *nfds, CMSG_DATA(c), count * sizeof(int));
+      *nfds += count;
+    }
+  }
+  ret = read_all(sock, (char *)rq + n, sizeof *rq - n);
+  if (ret == 1 && *nfds != !!(rq->mask & 1) + !!(rq->mask & 2) + !!(rq->mask & 4))
+    bad = 1;
+  if (ret == 1 && bad) {
+    for (i = 0; i < *nfds; i++) close(fds[i]);
+    *nfds = 0;
+    errno = EMSGSIZE;
+    return -1;
+  }
+  return ret;
+}
+
+static void fs_reply(int sock, int kind, int pid, int value)
+{
+  struct fs_reply r;
+  r.kind = kind;
+  r.pid = pid;
+  r.value = value;
+  send_all(sock, (const char *)&r, sizeof r);
+}
+
+/* Self-pipe through which SIGCHLD wakes the helper */
+static int fs_sigpipe[2] = {-1, -1};
+
+static void fs_sigchld(int sig)
+{
+  int saved = errno;
+  ssize_t n = write(fs_sigpipe[1], "", 1);
+  (void)sig;
+  (void)n;
+  errno = saved;
+}
+
+/* Closes the descriptors in [first, last) */
+static void fs_close_range(int first, int last)
+{
+#if defined(__linux__) && defined(SYS_close_range)
+  if (first < last && 0 == syscall(SYS_close_range, first,
+                                   last == INT_MAX ? ~0U : (unsigned)last - 1, 0))
+    return;
+#endif
+  if (last == INT_MAX) last = OPEN_MAX;
+  for (; first < last; first++) close(first);
+}
+
+/* Runs in the child forked by the helper: sets up its standard streams then
+ * execs the command or runs the chunk, never returns */
+static void fs_child(lua_State *S, const struct fs_request *rq, char *payload,
+                     const int *fds, int nfds)
+{
+  char **str = malloc((rq->count + 1) * sizeof *str);
+  unsigned *len = malloc((rq->count + 1) * sizeof *len);
+  char *pos = payload, *end = payload + rq->len;
+  unsigned i;
+  int k = 0, code = 0;
+  for (i = 0; i < 3; i++)
+    if (rq->mask & (1 << i) && -1 == dup2(fds[k++], i)) _exit(127);
+  for (k = 0; k < nfds; k++)
+    if (fds[k] > 2) close(fds[k]);
+  if (!str || !len) _exit(127);
+  for (i = 0; i < rq->count; i++) {
+    if (end - pos < (ptrdiff_t)sizeof len[i]) _exit(127);
+    memcpy(&len[i], pos, sizeof len[i]);
+    str[i] = pos + sizeof len[i];
+    pos = str[i] + len[i] + 1;
+    if (pos > end) _exit(127);
+  }
+  str[rq->count] = 0;
+  if (rq->kind == 'X') {
+    execvp(str[0], str);
+    _exit(127);
+  }
+  if (0 != luaL_loadbuffer(S, str[0], len[0], "=forkserver")) {
+    code = 1;
+  }
+  else {
+    for (i = 1; i < rq->count; i++)
+      lua_pushlstring(S, str[i], len[i]);
+    if (0 != lua_pcall(S, rq->count - 1, 1, 0))
+      code = 1;
+    else if (lua_isnumber(S, -1))
+      code = (int)lua_tonumber(S, -1);
+    else if (lua_isboolean(S, -1) && !lua_toboolean(S, -1))
+      code = 1;
+  }
+  if (code == 1 && lua_isstring(S, -1))
+    fprintf(stderr, "%s\n", lua_tostring(S, -1));
+  fflush(0);
+  _exit(code);
+}
+
+/* Body of the helper: loads the libraries, runs the init chunk and then
+ * serves requests until the parent closes the socket */
+static void fs_helper(int sock, const char *init, size_t init_len,
+                      const char **preload)
+{
+  struct sigaction sa;
+  sigset_t none;
+  lua_State *S;
+  int ok = 0;
+  fs_close_range(3, sock);
+  fs_close_range(sock + 1, INT_MAX);
+  sigemptyset(&none);
+  sigprocmask(SIG_SETMASK, &none, 0);
+  signal(SIGPIPE, SIG_IGN);
+  if (0 == pipe(fs_sigpipe)) {
+    fcntl(fs_sigpipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(fs_sigpipe[1], F_SETFL, O_NONBLOCK);
+    memset(&sa, 0, sizeof sa);
+    sa.sa_handler = fs_sigchld;
+    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigemptyset(&sa.sa_mask);
+    ok = 0 == sigaction(SIGCHLD, &sa, 0);
+  }
+  S = ok ? luaL_newstate() : 0;
+  if (S) {
+    luaL_openlibs(S);
+    for (; *preload && ok; preload++) {
+      lua_getglobal(S, "require");
+      lua_pushstring(S, *preload);
+      ok = 0 == lua_pcall(S, 1, 0, 0);
+    }
+    if (ok && init)
+      ok = 0 == luaL_loadbuffer(S, init, init_len, "=forkserver")
+           && 0 == lua_pcall(S, 0, 0, 0);
+    if (!ok) fprintf(stderr, "forkserver: %s\n", lua_tostring(S, -1));
+  }
+  fs_reply(sock, 'R', getpid(), ok ? 0 : -1);
+  if (!ok) _exit(1);
+  for (;;) {
+    struct pollfd pfd[2];
+    struct fs_request rq;
+    int fds[3], nfds = 0, status, i;
+    char *payload;
+    pid_t pid;
+    pfd[0].fd = sock;
+    pfd[1].fd = fs_sigpipe[0];
+    pfd[0].events = pfd[1].events = POLLIN;
+    if (-1 == poll(pfd, 2, -1)) {
+      if (errno == EINTR) continue;
+      _exit(1);
+    }
+    if (pfd[1].revents) {
+      char buf[64];
+      while (0 < read(fs_sigpipe[0], buf, sizeof buf));
+      while (0 < (pid = waitpid(-1, &status, WNOHANG)))
+        fs_reply(sock, 'E', pid, status);
+    }
+    if (!pfd[0].revents) continue;
+    i = fs_recv_request(sock, &rq, fds, &nfds);
+    if (i == 0 || (i == -1 && errno != EMSGSIZE)) _exit(0);
+    payload = malloc(rq.len + 1);
+    if (!payload || 1 != read_all(sock, payload, rq.len)) _exit(1);
+    if (i == -1) {
+      fs_reply(sock, rq.kind == 'K' ? 'K' : 'S', -1, EMSGSIZE);
+      free(payload);
+      continue;
+    }
+    if (rq.kind == 'K') {
+      /* a child not reaped yet still owns its pid: signal it, unless it
+       * ended (reported now) or was already reaped */
+      int err = 0;
+      pid = waitpid(rq.pid, &status, WNOHANG);
+      if (pid == rq.pid) fs_reply(sock, 'E', pid, status);
+      else if (pid == -1) err = errno == ECHILD ? ESRCH : errno;
+      else if (-1 == kill(rq.pid, rq.sig)) err = errno;
+      fs_reply(sock, 'K', rq.pid, err);
+      free(payload);
+      continue;
+    }
+    pid = fork();
+    if (pid == 0) {
+      close(sock);
+      close(fs_sigpipe[0]);
+      close(fs_sigpipe[1]);
+      signal(SIGCHLD, SIG_DFL);
+      signal(SIGPIPE, SIG_DFL);
+      fs_child(S, &rq, payload, fds, nfds);
+    }
+    fs_reply(sock, 'S', pid, pid == -1 ? errno : 0);
+    for (i = 0; i < nfds; i++) close(fds[i]);
+    free(payload);
+  }
+}
+
+static int fs_writer(lua_State *L, const void *p, size_t sz, void *ud)
+{
+  (void)L;
+  luaL_addlstring((luaL_Buffer *)ud, p, sz);
+  return 0;
+}
+
+/* Replaces the function at idx by its binary chunk */
+static void fs_dump(lua_State *L, int idx)
+{
+  luaL_Buffer b;
+  idx = absindex(L, idx);
+  lua_pushvalue(L, idx);
+  luaL_buffinit(L, &b);
+  if (0 != lua_dumpfunction(L, fs_writer, &b))
+    luaL_error(L, "unable to dump given function");
+  luaL_pushresult(&b);
+  lua_replace(L, idx);
+  lua_pop(L, 1);
+}
+
+/* Replaces the strings from idx to the top by the payload of a request */
+static void fs_encode(lua_State *L, int idx)
+{
+  int i, top = lua_gettop(L);
+  luaL_checkstack(L, 3 * (top - idx + 1), "too many arguments");
+  for (i = idx; i <= top; i++) {
+    size_t len;
+    unsigned n;
+    if (!lua_isstring(L, i))
+      luaL_error(L, "bad spawn argument (string expected, got %s)",
+                 luaL_typename(L, i));
+    lua_tolstring(L, i, &len);
+    n = (unsigned)len;
+    lua_pushlstring(L, (const char *)&n, sizeof n);
+    lua_pushvalue(L, i);
+    lua_pushlstring(L, "", 1);
+  }
+  lua_concat(L, 3 * (top - idx + 1));
+  lua_replace(L, idx);
+  lua_settop(L, idx);
+}
+
+/* Reads the next reply, waiting up to timeout milliseconds (-1 forever).
+ * Returns 1 when read, 0 on timeout, -1 on error. */
+static int fs_read_reply(struct forkserver *fs, struct fs_reply *r, int timeout)
+{
+  int ret;
+  if (fs->sock == -1) {
+    errno = EPIPE;
+    return -1;
+  }
+  ret = poll_fd(fs->sock, POLLIN, timeout);
+  if (ret <= 0) return ret;
+  ret = read_all(fs->sock, (char *)r, sizeof *r);
+  if (ret == 0) errno = EPIPE;
+  return ret == 1 ? 1 : -1;
+}
+
+/* Hands the exit status of a child to its handle, in the uservalue of the
+ * handle until it is waited for. The statuses table of the forkserver maps
+ * the pids of the children not reaped yet to the uservalues of their live
+ * handles, the status of a child whose handle was collected is dropped. */
+/* ... statuses -- ... statuses */
+static void fs_note(lua_State *L, int statuses, const struct fs_reply *r)
+{
+  lua_rawgeti(L, statuses, r->pid);     /* ... uv/nil */
+  if (lua_istable(L, -1)) {
+    lua_pushnumber(L, r->value);
+    lua_rawseti(L, -2, 2);
+    lua_pushnil(L);
+    lua_rawseti(L, statuses, r->pid);
+  }
+  lua_pop(L, 1);
+}
+
+/* [init [, {module...}]] -- forkserver/nil error */
+int lc_forkserver(lua_State *L)
+{
+  struct forkserver *fs;
+  struct fs_reply r;
+  const char *init = 0, **preload;
+  size_t init_len = 0;
+  int sv[2], i, n = 0;
+  lua_settop(L, 2);
+  if (lua_isfunction(L, 1)) fs_dump(L, 1);
+  if (!lua_isnil(L, 1)) init = luaL_checklstring(L, 1, &init_len);
+  if (!lua_isnil(L, 2)) {
+    luaL_checktype(L, 2, LUA_TTABLE);
+    n = lua_value_length(L, 2);
+  }
+  preload = lua_newuserdata(L, (n + 1) * sizeof *preload);
+  for (i = 0; i < n; i++) {
+    lua_rawgeti(L, 2, i + 1);
+    if (lua_type(L, -1) != LUA_TSTRING)
+      return luaL_error(L, "bad module name #%d (string expected, got %s)",
+                        i + 1, luaL_typename(L, -1));
+    preload[i] = lua_tostring(L, -1);   /* still anchored in the table */
+    lua_pop(L, 1);
+  }
+  preload[n] = 0;
+  fs = lua_newuserdata(L, sizeof *fs);
+  fs->sock = -1;
+  fs->pid = -1;
+  luaL_getmetatable(L, FORKSERVER_HANDLE);
+  lua_setmetatable(L, -2);
+  lua_newtable(L);                      /* children by pid, see fs_note */
+  lua_setuserdatatable(L, -2);
+  if (-1 == socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) return push_error(L);
+  fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+#if !defined(MSG_NOSIGNAL) && defined(SO_NOSIGPIPE)
+  i = 1;
+  setsockopt(sv[0], SOL_SOCKET, SO_NOSIGPIPE, &i, sizeof i);
+#endif
+  fs->pid = fork();
+  if (fs->pid == 0) {
+    close(sv[0]);
+    fs_helper(sv[1], init, init_len, preload);
+    _exit(0);
+  }
+  close(sv[1]);
+  if (fs->pid == -1) {
+    close(sv[0]);
+    return push_error(L);
+  }
+  fs->sock = sv[0];
+  i = fs_read_reply(fs, &r, -1);
+  if (i != 1 || r.kind != 'R' || r.value != 0) {
+    lua_replace(L, 1);
+    forkserver_close(L);
+    lua_pushnil(L);
+    lua_pushliteral(L, "forkserver initialization failed");
+    return 2;
+  }
+  return 1;
+}
+
+static struct forkserver *check_forkserver(lua_State *L)
+{
+  struct forkserver *fs = luaL_checkudata(L, 1, FORKSERVER_HANDLE);
+  if (fs->sock == -1) luaL_error(L, "attempt to use a closed forkserver");
+  return fs;
+}
+
+/* forkserver {arg0, ...[, lua=chunk][, stdin=, stdout=, stderr=]} -- child/nil error */
+int forkserver_spawn(lua_State *L)
+{
+  static const char *const streams[] = {"stdin", "stdout", "stderr"};
+  struct forkserver *fs = check_forkserver(L);
+  struct forkchild *c;
+  struct fs_request rq;
+  struct fs_reply r;
+  const char *payload;
+  size_t len;
+  int fds[3], nfds = 0, i, n;
+  luaL_checktype(L, 2, LUA_TTABLE);
+  lua_settop(L, 2);
+  memset(&rq, 0, sizeof rq);
+  for (i = 0; i < 3; i++) {
+    lua_getfield(L, 2, streams[i]);
+    if (!lua_isnil(L, -1)) {
+      flush_file(L, -1);
+      fds[nfds++] = check_fd(L, -1, streams[i]);
+      rq.mask |= 1 << i;
+    }
+    lua_pop(L, 1);
+  }
+  n = lua_value_length(L, 2);
+  lua_getuserdatatable(L, 1);           /* fs opts statuses */
+  lua_getfield(L, 2, "lua");
+  if (lua_isnil(L, -1)) {
+    lua_pop(L, 1);
+    if (n == 0) return luaL_error(L, "bad spawn options (command or lua chunk expected)");
+    rq.kind = 'X';
+  }
   else {
-    idx = absindex(L, idx);
-    pf = lua_touserdata(L, idx);
-    luaL_getmetatable(L, LUA_FILEHANDLE);
-    if (!pf || !lua_getmetatable(L, idx) || !lua_rawequal(L, -1, -2))
-      luaL_error(L, "bad %s option (%s expected, got %s)",
-                 argname, LUA_FILEHANDLE, luaL_typename(L, idx));
-    lua_pop(L, 2);
+    if (lua_isfunction(L, -1)) fs_dump(L, -1);
+    else if (!lua_isstring(L, -1))
+      return luaL_error(L, "bad lua option (function or string expected, got %s)",
+                        luaL_typename(L, -1));
+    rq.kind = 'L';
   }
-  if (!*pf) return luaL_error(L, "attempt to use a closed file"), NULL;
-  return *pf;
+  for (i = 1; i <= n; i++) lua_rawgeti(L, 2, i);
+  rq.count = lua_gettop(L) - 3;
+  fs_encode(L, 4);                      /* fs opts statuses payload */
+  payload = lua_tolstring(L, 4, &len);
+  rq.len = (unsigned)len;
+  if (-1 == fs_send_request(fs->sock, &rq, fds, nfds, payload))
+    return push_error(L);
+  do {
+    if (1 != fs_read_reply(fs, &r, -1)) return push_error(L);
+    if (r.kind == 'E') fs_note(L, 3, &r);
+  } while (r.kind != 'S');
+  if (r.pid == -1) {
+    errno = r.value;
+    return push_error(L);
+  }
+  c = lua_newuserdata(L, sizeof *c);
+  c->pid = r.pid;
+  c->status = -1;
+  c->signal = c->core = 0;
+  luaL_getmetatable(L, FORKCHILD_HANDLE);
+  lua_setmetatable(L, -2);
+  lua_createtable(L, 2, 0);             /* keeps the server alive */
+  lua_pushvalue(L, 1);
+  lua_rawseti(L, -2, 1);
+  lua_pushvalue(L, -1);
+  lua_rawseti(L, 3, c->pid);
+  lua_setuserdatatable(L, -2);
+  return 1;
 }
 
-#define new_dirent(L) lua_newtable(L)
+/* Stops the helper, children still running are left alone */
+/* forkserver -- true */
+int forkserver_close(lua_State *L)
+{
+  struct forkserver *fs = luaL_checkudata(L, 1, FORKSERVER_HANDLE);
+  if (fs->sock != -1) {
+    close(fs->sock);
+    fs->sock = -1;
+  }
+  if (fs->pid > 0) {
+    int status;
+    while (-1 == waitpid(fs->pid, &status, 0) && errno == EINTR);
+    fs->pid = -1;
+  }
+  lua_pushboolean(L, 1);
+  return 1;
+}
 
-static void get_redirect(lua_State *L,
-                         int idx, const char *stdname, struct spawn_params *p)
+/* child [blocking/timeout] -- exitcode/true timeout/nil error */
+int forkchild_wait(lua_State *L)
 {
-  lua_getfield(L, idx, stdname);
-  if (!lua_isnil(L, -1))
-    spawn_param_redirect(p, stdname, fileno(check_file(L, -1, stdname)));
+  struct forkchild *c = luaL_checkudata(L, 1, FORKCHILD_HANDLE);
+  struct forkserver *fs;
+  struct timespec start, now;
+  int timeout = -1;
+  if (lua_isboolean(L, 2))
+    timeout = lua_toboolean(L, 2) ? -1 : 0;
+  else
+    timeout = opt_timeout(L, 2, -1);
+  lua_settop(L, 1);
+  lua_getuserdatatable(L, 1);
+  lua_rawgeti(L, 2, 1);
+  fs = lua_touserdata(L, 3);
+  lua_getuserdatatable(L, 3);           /* child uv fs statuses */
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  while (c->status == -1) {
+    struct fs_reply r;
+    int wait = timeout, ret;
+    lua_rawgeti(L, 2, 2);
+    if (!lua_isnil(L, -1)) {
+      int status = (int)lua_tonumber(L, -1);
+      if (WIFSIGNALED(status)) {
+        c->signal = WTERMSIG(status);
+#ifdef WCOREDUMP
+        c->core = WCOREDUMP(status) != 0;
+#endif
+        c->status = 128 + c->signal;
+      }
+      else {
+        c->status = WEXITSTATUS(status);
+      }
+      break;
+    }
+    lua_pop(L, 1);
+    if (timeout > 0) {
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      wait = timeout - (int)((now.tv_sec - start.tv_sec) * 1000
+                             + (now.tv_nsec - start.tv_nsec) / 1000000);
+      if (wait < 0) wait = 0;
+    }
+    ret = fs_read_reply(fs, &r, wait);
+    if (ret == -1) return push_error(L);
+    if (ret == 0) {
+      lua_pushboolean(L, 1);
+      return 1;
+    }
+    if (r.kind == 'E') fs_note(L, 4, &r);
+  }
+  lua_pushnumber(L, c->status);
+  return 1;
+}
+
+/* Asks the helper to signal the child: only it knows whether the pid was
+ * reaped and may have been reused. A child that ended already is left
+ * alone, its status is noted on the way. */
+/* child [signal] -- true/nil error */
+int forkchild_terminate(lua_State *L)
+{
+  struct forkchild *c = luaL_checkudata(L, 1, FORKCHILD_HANDLE);
+  int sig = lua_isnoneornil(L, 2) ? SIGTERM : check_signal(L, 2, "signal");
+  struct forkserver *fs;
+  struct fs_request rq;
+  struct fs_reply r;
+  if (c->status != -1) {
+    lua_pushboolean(L, 1);
+    return 1;
+  }
+  lua_settop(L, 1);
+  lua_getuserdatatable(L, 1);
+  lua_rawgeti(L, 2, 1);
+  fs = lua_touserdata(L, 3);
+  lua_getuserdatatable(L, 3);           /* child uv fs statuses */
+  if (fs->sock == -1) return luaL_error(L, "attempt to use a closed forkserver");
+  memset(&rq, 0, sizeof rq);
+  rq.kind = 'K';
+  rq.pid = c->pid;
+  rq.sig = sig;
+  if (-1 == fs_send_request(fs->sock, &rq, 0, 0, "")) return push_error(L);
+  do {
+    if (1 != fs_read_reply(fs, &r, -1)) return push_error(L);
+    if (r.kind == 'E') fs_note(L, 4, &r);
+  } while (r.kind != 'K');
+  if (r.value != 0 && r.value != ESRCH) {
+    errno = r.value;
+    return push_error(L);
+  }
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+/* Forgets the child in the statuses table of its forkserver */
+/* child -- */
+int forkchild_gc(lua_State *L)
+{
+  struct forkchild *c = luaL_checkudata(L, 1, FORKCHILD_HANDLE);
+  lua_settop(L, 1);
+  lua_getuserdatatable(L, 1);
+  lua_rawgeti(L, 2, 1);
+  lua_getuserdatatable(L, 3);           /* child uv fs statuses */
+  lua_rawgeti(L, 4, c->pid);
+  if (lua_rawequal(L, -1, 2)) {         /* not a later child with its pid */
+    lua_pushnil(L);
+    lua_rawseti(L, 4, c->pid);
+  }
+  return 0;
+}
+
+/* child -- pid */
+int forkchild_pid(lua_State *L)
+{
+  struct forkchild *c = luaL_checkudata(L, 1, FORKCHILD_HANDLE);
+  lua_pushnumber(L, c->pid);
+  return 1;
+}
+
+/* Coroutines suspended in lc.async calls until lc.loop finds what they wait
+ * for ready. Each task waits for one thing on behalf of one coroutine, the
+ * uservalue of the loop anchors the coroutine and the object it uses. */
+
+enum { TASK_FREE, TASK_WAIT, TASK_READ, TASK_READALL, TASK_WRITE, TASK_RUN };
+
+#define LOOP_KEY "luachild.loop"
+#define LOOP_NAP 10                     /* ms between checks of children without pidfd */
+#define LOOP_EVENTS 64
+
+struct task {
+  int kind;
+  unsigned gen;                         /* tells apart the users of a slot */
+  int nres;                             /* results pushed on co once done */
+  int napping;                          /* child checked every LOOP_NAP ms */
+  lua_State *co;
+  int fd;                               /* the pidfd while waiting for a child */
+  size_t want;                          /* TASK_READ */
+  const char *data;                     /* TASK_WRITE, anchored */
+  size_t len, pos;
+  struct capture c;                     /* TASK_READALL */
+  struct process *proc;                 /* TASK_WAIT and TASK_RUN, anchored */
+  struct run_state *st;                 /* TASK_RUN */
+  int capture[2];
+  int err;                              /* TASK_RUN failed, once reaped */
+};
+
+struct loop {
+  int epfd;                             /* -1 without epoll */
+  int count, size, naps;
+  struct task *tasks;
+  int *done, ndone;                     /* tasks to resume */
+};
+
+/* -- loop */
+static struct loop *loop_get(lua_State *L)
+{
+  struct loop *lp;
+  lua_getfield(L, LUA_REGISTRYINDEX, LOOP_KEY);
+  if (!lua_isnil(L, -1)) return lua_touserdata(L, -1);
+  lua_pop(L, 1);
+  lp = lua_newuserdata(L, sizeof *lp);
+  memset(lp, 0, sizeof *lp);
+  lp->epfd = -1;
+#ifdef __linux__
+  lp->epfd = epoll_create(LOOP_EVENTS);
+  if (lp->epfd != -1) fcntl(lp->epfd, F_SETFD, FD_CLOEXEC);
+#endif
+  luaL_getmetatable(L, LOOP_HANDLE);
+  lua_setmetatable(L, -2);
+  lua_newtable(L);
+  lua_setuserdatatable(L, -2);
+  lua_pushvalue(L, -1);
+  lua_setfield(L, LUA_REGISTRYINDEX, LOOP_KEY);
+  return lp;
+}
+
+int loop_gc(lua_State *L)
+{
+  struct loop *lp = luaL_checkudata(L, 1, LOOP_HANDLE);
+  int i;
+  for (i = 0; i < lp->size; i++) {
+    if (lp->tasks[i].st) {
+      run_free(lp->tasks[i].st);
+      free(lp->tasks[i].st);
+    }
+    free(lp->tasks[i].c.buf);
+  }
+  free(lp->tasks);
+  free(lp->done);
+  lp->tasks = 0;
+  lp->done = 0;
+  lp->size = lp->count = 0;
+  if (lp->epfd != -1) close(lp->epfd);
+  lp->epfd = -1;
+  return 0;
+}
+
+/* Lists the descriptors task t waits on and the slot telling them apart:
+ * 0 to 2 for those of lc.async.run, 3 for a pidfd, 0 otherwise */
+static int task_fds(const struct task *t, struct pollfd *pfd, int *slot)
+{
+  int i, n = 0;
+  if (t->kind == TASK_READ || t->kind == TASK_READALL || t->kind == TASK_WRITE) {
+    pfd[0].fd = t->fd;
+    pfd[0].events = t->kind == TASK_WRITE ? POLLOUT : POLLIN;
+    slot[0] = 0;
+    return 1;
+  }
+  if (t->st && run_pollfds(t->st, pfd)) {
+    if (t->st->in_fd != -1) {
+      pfd[n].fd = t->st->in_fd;
+      pfd[n].events = POLLOUT;
+      slot[n++] = 0;
+    }
+    for (i = 0; i < 2; i++)
+      if (t->st->out[i].fd != -1) {
+        pfd[n].fd = t->st->out[i].fd;
+        pfd[n].events = POLLIN;
+        slot[n++] = i + 1;
+      }
+    return n;
+  }
+  if (t->fd != -1) {
+    pfd[0].fd = t->fd;
+    pfd[0].events = POLLIN;
+    slot[0] = 3;
+    n = 1;
+  }
+  return n;
+}
+
+/* Registers the descriptors of task idx with epoll, returns -1 on error */
+static int task_watch(struct loop *lp, int idx)
+{
+#ifdef __linux__
+  struct task *t = &lp->tasks[idx];
+  struct pollfd pfd[3];
+  int i, n, slot[3];
+  if (lp->epfd == -1) return 0;
+  n = task_fds(t, pfd, slot);
+  for (i = 0; i < n; i++) {
+    struct epoll_event ev;
+    ev.events = pfd[i].events == POLLOUT ? EPOLLOUT : EPOLLIN;
+    ev.data.u64 = (uint64_t)t->gen << 32 | (uint64_t)idx << 2 | slot[i];
+    if (-1 == epoll_ctl(lp->epfd, EPOLL_CTL_ADD, pfd[i].fd, &ev)) {
+      int en = errno;
+      while (i-- > 0) epoll_ctl(lp->epfd, EPOLL_CTL_DEL, pfd[i].fd, &ev);
+      errno = en;
+      return -1;
+    }
+  }
+#else
+  (void)lp;
+  (void)idx;
+#endif
+  return 0;
+}
+
+static void task_unwatch(struct loop *lp, struct task *t)
+{
+#ifdef __linux__
+  struct pollfd pfd[3];
+  struct epoll_event ev;
+  int i, n, slot[3];
+  if (lp->epfd == -1) return;
+  n = task_fds(t, pfd, slot);
+  for (i = 0; i < n; i++)
+    epoll_ctl(lp->epfd, EPOLL_CTL_DEL, pfd[i].fd, &ev);
+#else
+  (void)lp;
+  (void)t;
+#endif
+}
+
+/* Waits for the child of task idx, through its pidfd when possible */
+static void task_wait_child(struct loop *lp, int idx)
+{
+  struct task *t = &lp->tasks[idx];
+  t->fd = t->proc->pidfd;
+  if (t->fd != -1 && (lp->epfd == -1 || -1 == task_watch(lp, idx)))
+    t->fd = -1;                         /* e.g. another task waits on it */
+  if (t->fd == -1) {
+    t->napping = 1;
+    lp->naps++;
+  }
+}
+
+/* Adds a task for the running coroutine, anchoring it and the values from
+ * obj (if not 0) to the top. Returns its index, the loop is left on the
+ * stack. */
+/* ... -- ... loop */
+static int task_new(lua_State *L, int kind, int obj)
+{
+  struct loop *lp;
+  struct task *t;
+  int i, idx, top = lua_gettop(L);
+  if (lua_pushthread(L))
+    luaL_error(L, "lc.async functions must be called from a coroutine");
+  lua_pop(L, 1);
+  lp = loop_get(L);
+  if (lp->count == lp->size) {
+    int size = lp->size ? 2 * lp->size : 16;
+    struct task *tasks = realloc(lp->tasks, size * sizeof *tasks);
+    int *done;
+    if (tasks) lp->tasks = tasks;
+    done = tasks ? realloc(lp->done, size * sizeof *done) : 0;
+    if (!done) luaL_error(L, "not enough memory");
+    lp->done = done;
+    memset(tasks + lp->size, 0, (size - lp->size) * sizeof *tasks);
+    lp->size = size;
+  }
+  for (idx = 0; lp->tasks[idx].kind != TASK_FREE; idx++);
+  t = &lp->tasks[idx];
+  t->kind = kind;
+  t->nres = t->napping = 0;
+  t->co = L;
+  t->fd = -1;
+  t->data = 0;
+  t->proc = 0;
+  t->st = 0;
+  t->err = 0;
+  t->c.buf = 0;
+  t->c.len = t->c.size = 0;
+  lp->count++;
+  lua_getuserdatatable(L, -1);          /* ... loop anchors */
+  lua_createtable(L, 2, 0);
+  lua_pushthread(L);
+  lua_rawseti(L, -2, 1);
+  for (i = obj; obj && i <= top; i++) {
+    lua_pushvalue(L, i);
+    lua_rawseti(L, -2, i - obj + 2);
+  }
+  lua_rawseti(L, -2, idx + 1);
+  lua_pop(L, 1);
+  return idx;
+}
+
+/* Forgets task idx */
+/* ... anchors ... -- ... anchors ... */
+static void task_free(lua_State *L, struct loop *lp, int anchors, int idx)
+{
+  struct task *t = &lp->tasks[idx];
+  if (!t->nres) task_unwatch(lp, t);
+  if (t->st) {
+    run_free(t->st);
+    free(t->st);
+    t->st = 0;
+  }
+  free(t->c.buf);
+  t->c.buf = 0;
+  if (t->napping) lp->naps--;
+  t->kind = TASK_FREE;
+  t->gen++;
+  lp->count--;
+  lua_pushnil(L);
+  lua_rawseti(L, anchors, idx + 1);
+}
+
+/* Registers task idx for the events it waits for and suspends the coroutine,
+ * returns the results of the call once resumed */
+/* ... loop -- */
+static int task_suspend(lua_State *L, struct loop *lp, int idx)
+{
+  if (-1 == task_watch(lp, idx)) {
+    int en = errno;
+    lua_getuserdatatable(L, -1);
+    task_free(L, lp, lua_gettop(L), idx);
+    errno = en;
+    return push_error(L);
+  }
+  lua_settop(L, 0);
+  return lua_yield(L, 0);
+}
+
+/* Pushes the result of the child of task idx on its coroutine */
+static int task_result(lua_State *L, int anchors, int idx, struct task *t)
+{
+  lua_State *co = t->co;
+  if (t->kind == TASK_WAIT) {
+    lua_pushnumber(co, t->proc->status);
+    return 1;
+  }
+  lua_rawgeti(L, anchors, idx + 1);
+  lua_rawgeti(L, -1, 2);
+  lua_xmove(L, co, 1);                  /* co: proc */
+  lua_pop(L, 1);
+  run_push(co, t->st, t->proc, t->capture);
+  return 1;
+}
+
+/* Does what task idx waits for, after its descriptor on slot reported
+ * revents. Returns the number of results pushed on the coroutine once done,
+ * 0 while not done. SIGPIPE must be blocked by the caller. */
+static int task_step(lua_State *L, struct loop *lp, int anchors, int idx,
+                     int slot, int revents)
+{
+  struct task *t = &lp->tasks[idx];
+  lua_State *co = t->co;
+  char buf[RELAY_CHUNK];
+  ssize_t n;
+  int ret;
+  switch (t->kind) {
+  case TASK_READ:
+    do n = read(t->fd, buf, t->want < sizeof buf ? t->want : sizeof buf);
+    while (n == -1 && errno == EINTR);
+    if (n == -1) return errno == EAGAIN ? 0 : push_error(co);
+    if (n == 0) lua_pushnil(co);
+    else lua_pushlstring(co, buf, n);
+    return 1;
+  case TASK_READALL:
+    if (t->c.len == t->c.size) {
+      size_t size = t->c.size ? 2 * t->c.size : RELAY_CHUNK;
+      char *grown = realloc(t->c.buf, size);
+      if (!grown) return push_error(co);
+      t->c.buf = grown;
+      t->c.size = size;
+    }
+    do n = read(t->fd, t->c.buf + t->c.len, t->c.size - t->c.len);
+    while (n == -1 && errno == EINTR);
+    if (n == -1) return errno == EAGAIN ? 0 : push_error(co);
+    if (n > 0) {
+      t->c.len += n;
+      return 0;
+    }
+    lua_pushlstring(co, t->c.buf, t->c.len);
+    return 1;
+  case TASK_WRITE:
+    /* POLLOUT promises room for PIPE_BUF bytes, more could block */
+    do n = write(t->fd, t->data + t->pos,
+                 t->len - t->pos < PIPE_BUF ? t->len - t->pos : PIPE_BUF);
+    while (n == -1 && errno == EINTR);
+    if (n == -1) return errno == EAGAIN ? 0 : push_error(co);
+    t->pos += n;
+    if (t->pos < t->len) return 0;
+    lua_pushboolean(co, 1);
+    return 1;
+  case TASK_RUN:
+    if (slot < 3) {
+      struct pollfd pfd[3];
+      int fd = slot == 0 ? t->st->in_fd : t->st->out[slot - 1].fd;
+      if (fd != -1 && -1 == run_handle(t->st, fd, revents)) {
+        /* closing the pipes first lets a child blocked on them go on, and
+         * the error is reported once it is reaped without blocking */
+        t->err = errno;
+        run_free(t->st);
+      }
+      if (run_pollfds(t->st, pfd)) return 0;
+      task_wait_child(lp, idx);         /* all the pipes are closed */
+    }
+    /* FALLTHROUGH */
+  case TASK_WAIT:
+    ret = process_update(t->proc, 0);
+    if (ret == -1) return push_error(co);
+    if (ret && t->err) {
+      errno = t->err;
+      return push_error(co);
+    }
+    return ret ? task_result(L, anchors, idx, t) : 0;
+  }
+  return 0;
+}
+
+/* Steps task idx and queues it for resuming once done */
+static void loop_step(lua_State *L, struct loop *lp, int anchors, int idx,
+                      int slot, int revents)
+{
+  int n = task_step(L, lp, anchors, idx, slot, revents);
+  if (n) {
+    struct task *t = &lp->tasks[idx];
+    task_unwatch(lp, t);
+    if (t->napping) lp->naps--;
+    t->napping = 0;
+    t->nres = n;
+    lp->done[lp->ndone++] = idx;
+  }
+}
+
+/* Waits up to timeout milliseconds for the tasks and steps the ready ones */
+static int loop_poll(lua_State *L, struct loop *lp, int anchors, int timeout)
+{
+  struct sigpipe_guard guard;
+  int i, n;
+#ifdef __linux__
+  struct epoll_event ev[LOOP_EVENTS];
+  if (lp->epfd != -1) {
+    n = epoll_wait(lp->epfd, ev, LOOP_EVENTS, timeout);
+    if (n == -1) return errno == EINTR ? 0 : -1;
+    sigpipe_block(&guard);
+    for (i = 0; i < n; i++) {
+      uint64_t key = ev[i].data.u64;
+      int idx = (int)(key >> 2 & 0x3fffffff);
+      struct task *t = idx < lp->size ? &lp->tasks[idx] : 0;
+      if (t && t->kind != TASK_FREE && !t->nres
+          && t->gen == (unsigned)(key >> 32))
+        loop_step(L, lp, anchors, idx, (int)(key & 3),
+                  ev[i].events & EPOLLOUT ? POLLOUT : POLLIN);
+    }
+  }
+  else
+#endif
+  {
+    struct pollfd *pfd = malloc(3 * lp->size * sizeof *pfd);
+    int *key = malloc(3 * lp->size * sizeof *key);
+    int j, slot[3];
+    if (!pfd || !key) {
+      free(pfd);
+      free(key);
+      errno = ENOMEM;
+      return -1;
+    }
+    for (i = n = 0; i < lp->size; i++)
+      if (lp->tasks[i].kind != TASK_FREE && !lp->tasks[i].nres) {
+        int m = task_fds(&lp->tasks[i], pfd + n, slot);
+        for (j = 0; j < m; j++) key[n + j] = i << 2 | slot[j];
+        n += m;
+      }
+    do i = poll(pfd, n, timeout); while (i == -1 && errno == EINTR);
+    if (i == -1) {
+      free(pfd);
+      free(key);
+      return -1;
+    }
+    sigpipe_block(&guard);
+    for (i = 0; i < n; i++) {
+      struct task *t = &lp->tasks[key[i] >> 2];
+      /* a task can be done already after an event of another of its pipes */
+      if (pfd[i].revents && !t->nres)
+        loop_step(L, lp, anchors, key[i] >> 2, key[i] & 3, pfd[i].revents);
+    }
+    free(pfd);
+    free(key);
+  }
+  if (lp->naps)
+    for (i = 0; i < lp->size; i++)
+      if (lp->tasks[i].napping)
+        loop_step(L, lp, anchors, i, 3, 0);
+  sigpipe_restore(&guard);
+  return 0;
+}
+
+/* Resumes the coroutines of the tasks done, an error raised by one is
+ * raised again */
+static void loop_resume(lua_State *L, struct loop *lp, int anchors)
+{
+  while (lp->ndone) {
+    int idx = lp->done[--lp->ndone], status;
+    struct task *t = &lp->tasks[idx];
+    lua_State *co = t->co;
+    int nres = t->nres;
+    lua_rawgeti(L, anchors, idx + 1);   /* keeps co alive */
+    task_free(L, lp, anchors, idx);
+    status = lua_resumethread(co, L, nres);
+    if (status != 0 && status != LUA_YIELD) {
+      lua_xmove(co, L, 1);
+      lua_error(L);
+    }
+    if (status == 0) lua_settop(co, 0);
+    lua_pop(L, 1);
+  }
+}
+
+/* [timeout] -- true/false */
+int lc_loop(lua_State *L)
+{
+  struct loop *lp;
+  struct timespec start, now;
+  int timeout = opt_timeout(L, 1, -1);
+  lua_settop(L, 1);
+  lp = loop_get(L);
+  lua_getuserdatatable(L, 2);           /* timeout loop anchors */
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  loop_resume(L, lp, 3);
+  while (lp->count) {
+    int wait = timeout;
+    if (timeout >= 0) {
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      wait = timeout - (int)((now.tv_sec - start.tv_sec) * 1000
+                             + (now.tv_nsec - start.tv_nsec) / 1000000);
+      if (wait <= 0 && timeout > 0) break;
+      if (wait < 0) wait = 0;
+    }
+    if (lp->naps && (wait == -1 || wait > LOOP_NAP)) wait = LOOP_NAP;
+    if (-1 == loop_poll(L, lp, 3, wait))
+      return luaL_error(L, "event loop failed: %s", strerror(errno));
+    loop_resume(L, lp, 3);
+    if (timeout == 0) break;
+  }
+  lua_pushboolean(L, lp->count == 0);
+  return 1;
+}
+
+/* proc -- exitcode/nil error */
+int async_wait(lua_State *L)
+{
+  struct process *p = luaL_checkudata(L, 1, PROCESS_HANDLE);
+  struct loop *lp;
+  int idx, ret = process_update(p, 0);
+  if (ret == -1) return push_error(L);
+  if (ret == 1) {
+    lua_pushnumber(L, p->status);
+    return 1;
+  }
+  lua_settop(L, 1);
+  idx = task_new(L, TASK_WAIT, 1);
+  lp = lua_touserdata(L, -1);
+  lp->tasks[idx].proc = p;
+  task_wait_child(lp, idx);
+  lua_settop(L, 0);
+  return lua_yield(L, 0);
+}
+
+/* file [n/"a"] -- data/nil error */
+int async_read(lua_State *L)
+{
+  int fd = check_fd(L, 1, "file");
+  const char *fmt = lua_type(L, 2) == LUA_TSTRING ? lua_tostring(L, 2) : 0;
+  struct loop *lp;
+  size_t want = 0;
+  int idx;
+  if (fmt && *fmt == '*') fmt++;
+  if (fmt && *fmt != 'a')
+    return luaL_argerror(L, 2, "invalid format");
+  /* checked before the task exists, a task left unwatched hangs lc.loop */
+  if (!fmt) {
+    lua_Number n = luaL_optnumber(L, 2, RELAY_CHUNK);
+    if (!(n >= 1 && n <= (lua_Number)SIZE_ARG_MAX))
+      return luaL_argerror(L, 2, "positive size expected");
+    want = (size_t)n;
+  }
+  lua_settop(L, 2);
+  idx = task_new(L, fmt ? TASK_READALL : TASK_READ, 1);
+  lp = lua_touserdata(L, -1);
+  lp->tasks[idx].fd = fd;
+  lp->tasks[idx].want = want;
+  return task_suspend(L, lp, idx);
+}
+
+/* file data -- true/nil error */
+int async_write(lua_State *L)
+{
+  int fd = check_fd(L, 1, "file");
+  size_t len;
+  const char *data = luaL_checklstring(L, 2, &len);
+  struct loop *lp;
+  int idx;
+  lua_settop(L, 2);
+  flush_file(L, 1);
+  if (len == 0) {
+    lua_pushboolean(L, 1);
+    return 1;
+  }
+  idx = task_new(L, TASK_WRITE, 1);
+  lp = lua_touserdata(L, -1);
+  lp->tasks[idx].fd = fd;
+  lp->tasks[idx].data = data;
+  lp->tasks[idx].len = len;
+  lp->tasks[idx].pos = 0;
+  return task_suspend(L, lp, idx);
+}
+
+/* args-opts -- result/nil error */
+int async_run(lua_State *L)
+{
+  struct run_state *st;
+  struct pollfd pfd[3];
+  struct loop *lp;
+  int idx, ret, capture[2];
+  if (lua_pushthread(L))
+    return luaL_error(L, "lc.async functions must be called from a coroutine");
   lua_pop(L, 1);
+  st = malloc(sizeof *st);
+  if (!st) return luaL_error(L, "not enough memory");
+  ret = run_spawn(L, st, capture);      /* ... proc/nil error */
+  if (ret != 1) {
+    free(st);
+    return ret;
+  }
+  idx = task_new(L, TASK_RUN, lua_gettop(L));
+  lp = lua_touserdata(L, -1);
+  lp->tasks[idx].proc = lua_touserdata(L, -2);
+  lp->tasks[idx].st = st;
+  lp->tasks[idx].capture[0] = capture[0];
+  lp->tasks[idx].capture[1] = capture[1];
+  if (!run_pollfds(st, pfd)) {
+    task_wait_child(lp, idx);
+    lua_settop(L, 0);
+    return lua_yield(L, 0);
+  }
+  return task_suspend(L, lp, idx);
+}
+
+/* A spawn whose options were parsed once, to be run any number of times */
+struct command {
+  const char *command, **argv, **envp;  /* envp is null for environ */
+  size_t argc;
+  struct spawn_actions actions;
+  struct spawn_attrs attrs;
+};
+
+/* args-opts -- command */
+int lc_command(lua_State *L)
+{
+  struct spawn_params *params;
+  struct command *c;
+  int i, n;
+  luaL_checktype(L, 1, LUA_TTABLE);
+  lua_settop(L, 1);
+  params = spawn_prepare(L);            /* cmd opts ... */
+  if (!params) return 0;
+  c = lua_newuserdata(L, sizeof *c);
+  luaL_getmetatable(L, COMMAND_HANDLE);
+  lua_setmetatable(L, -2);
+  c->command = params->command;
+  c->argv = params->argv;
+  for (c->argc = 0; c->argv[c->argc]; c->argc++) ;
+  c->envp = params->envp;
+  c->actions = params->actions;
+  c->attrs = params->attrs;
+  /* the vectors, which hold their strings, the environment block and the
+   * files stay referenced by the command, not through the options, which
+   * the caller may change */
+  n = lua_gettop(L) - 1;
+  lua_createtable(L, n + 5, 0);         /* cmd opts ... command refs */
+  for (i = 1; i <= n; i++) {
+    lua_pushvalue(L, i);
+    lua_rawseti(L, -2, i);
+  }
+  for (i = 0; i < 4; i++) {
+    static const char *const fields[] = { "env", "stdin", "stdout", "stderr" };
+    lua_getfield(L, 2, fields[i]);
+    lua_rawseti(L, -2, n + 1 + i);
+  }
+  lua_getfield(L, 2, "fds");            /* cmd opts ... command refs fds */
+  if (lua_istable(L, -1)) {
+    lua_newtable(L);                    /* ... refs fds copy */
+    lua_pushnil(L);
+    while (lua_next(L, -3)) {           /* ... refs fds copy k v */
+      lua_pushvalue(L, -2);
+      lua_insert(L, -2);                /* ... refs fds copy k k v */
+      lua_rawset(L, -4);                /* ... refs fds copy k */
+    }
+    lua_replace(L, -2);                 /* ... refs copy */
+  }
+  lua_rawseti(L, -2, n + 5);            /* cmd opts ... command refs */
+  lua_setuserdatatable(L, -2);          /* cmd opts ... command */
+  return 1;
+}
+
+/* command [arg...] -- proc/nil error */
+int command_spawn(lua_State *L)
+{
+  struct command *c = luaL_checkudata(L, 1, COMMAND_HANDLE);
+  int i, extra = lua_gettop(L) - 1;
+  struct spawn_params *params;
+  const char **argv;
+  for (i = 2; i <= extra + 1; i++)
+    luaL_checkstring(L, i);
+  params = spawn_param_init(L);
+  spawn_param_filename(params, c->command);
+  argv = lua_newuserdata(L, (c->argc + extra + 1) * sizeof *argv);
+  memcpy(argv, c->argv, c->argc * sizeof *argv);
+  for (i = 0; i < extra; i++)
+    argv[c->argc + i] = lua_tostring(L, i + 2);
+  argv[c->argc + extra] = 0;
+  params->argv = argv;
+  params->envp = c->envp;
+  params->actions = c->actions;
+  params->attrs = c->attrs;
+  return spawn_param_execute(params);   /* proc/nil error */
+}
+
+/* stage in out err -- proc/nil error */
+static int spawn_stage(lua_State *L)
+{
+  struct spawn_params *params;
+  int i, fd[3];
+  for (i = 0; i < 3; i++)
+    fd[i] = lua_isnumber(L, i + 2) ? (int)lua_tonumber(L, i + 2) : -1;
+  lua_settop(L, 1);
+  params = spawn_prepare(L);
+  if (!params) return 0;
+  if (fd[0] != -1) spawn_param_redirect(params, "stdin", fd[0]);
+  if (fd[1] != -1) spawn_param_redirect(params, "stdout", fd[1]);
+  if (fd[2] != -1) spawn_param_redirect(params, "stderr", fd[2]);
+  return spawn_param_execute(params);   /* proc/nil error */
+}
+
+/* Terminates the stages already spawned when a later one fails */
+/* pipeline -- pipeline */
+static void pipeline_abort(lua_State *L, int pipeline)
+{
+  size_t i, n = lua_value_length(L, pipeline);
+  for (i = 1; i <= n; i++) {
+    lua_rawgeti(L, pipeline, i);
+    _process_terminate(lua_touserdata(L, -1));
+    lua_pop(L, 1);
+  }
 }
 
-/* filename [args-opts] -- proc/nil error */
-/* args-opts -- proc/nil error */
-int lc_spawn(lua_State *L)
+/* {stage...} -- pipeline/nil error */
+int lc_pipeline(lua_State *L)
 {
-  struct spawn_params *params;
-  int have_options;
-  switch (lua_type(L, 1)) {
-  default: return lua_report_type_error(L, 1, "string or table");
-  case LUA_TSTRING:
-    switch (lua_type(L, 2)) {
-    default: return lua_report_type_error(L, 2, "table");
-    case LUA_TNONE: have_options = 0; break;
-    case LUA_TTABLE: have_options = 1; break;
-    }
-    break;
-  case LUA_TTABLE:
-    have_options = 1;
-    lua_getfield(L, 1, "command");      /* opts ... cmd */
-    if (!lua_isnil(L, -1)) {
-      /* convert {command=command,arg1,...} to command {arg1,...} */
-      lua_insert(L, 1);                 /* cmd opts ... */
+  size_t i, n;
+  int in = -1, out = -1, err = -1, fd[2] = { -1, -1 };
+  luaL_checktype(L, 1, LUA_TTABLE);
+  lua_settop(L, 1);
+  n = lua_value_length(L, 1);
+  if (n < 1) return luaL_error(L, "a pipeline needs at least one stage");
+  lua_getfield(L, 1, "stdin");
+  if (!lua_isnil(L, -1)) in = check_fd(L, -1, "stdin");
+  lua_getfield(L, 1, "stdout");
+  if (!lua_isnil(L, -1)) out = check_fd(L, -1, "stdout");
+  lua_getfield(L, 1, "stderr");
+  if (!lua_isnil(L, -1)) err = check_fd(L, -1, "stderr");
+  lua_settop(L, 1);
+  lua_newtable(L);                      /* stages pipeline */
+  luaL_getmetatable(L, PIPELINE_HANDLE);
+  lua_setmetatable(L, 2);
+  for (i = 1; i <= n; i++) {
+    static const char *const streams[] = { "stdin", "stdout", "stderr" };
+    int stage_in = fd[0], stage_fd[3], j;
+    fd[0] = fd[1] = -1;
+    if (i < n && -1 == open_pipe(L, 0, fd)) {
+      int en = errno;
+      if (stage_in != in) close(stage_in);
+      pipeline_abort(L, 2);
+      errno = en;
+      return push_error(L);
     }
-    else {
-      /* convert {arg0,arg1,...} to arg0 {arg1,...} */
-      size_t i, n = lua_value_length(L, 1);
-      lua_rawgeti(L, 1, 1);             /* opts ... nil cmd */
-      lua_insert(L, 1);                 /* cmd opts ... nil */
-      for (i = 2; i <= n; i++) {
-        lua_rawgeti(L, 2, i);           /* cmd opts ... nil argi */
-        lua_rawseti(L, 2, i - 1);       /* cmd opts ... nil */
-      }
-      lua_rawseti(L, 2, n);             /* cmd opts ... */
+    lua_pushcfunction(L, spawn_stage);  /* stages pipeline spawn */
+    lua_rawgeti(L, 1, i);               /* stages pipeline spawn stage */
+    if (!lua_istable(L, -1)) {
+      if (stage_in != -1 && stage_in != in) close(stage_in);
+      close_fd(&fd[0]);
+      close_fd(&fd[1]);
+      pipeline_abort(L, 2);
+      return luaL_error(L, "bad stage %d (table expected, got %s)",
+                        (int)i, luaL_typename(L, -1));
     }
-    if (lua_type(L, 1) != LUA_TSTRING)
-      return luaL_error(L, "bad command option (string expected, got %s)",
-                        luaL_typename(L, 1));
-    break;
-  }
-  params = spawn_param_init(L);
-  /* get filename to execute */
-  spawn_param_filename(params, lua_tostring(L, 1));
-  /* get arguments, environment, and redirections */
-  if (have_options) {
-    lua_getfield(L, 2, "args");         /* cmd opts ... argtab */
-    switch (lua_type(L, -1)) {
-    default:
-      return luaL_error(L, "bad args option (table expected, got %s)",
-                        luaL_typename(L, -1));
-    case LUA_TNIL:
-      lua_pop(L, 1);                    /* cmd opts ... */
-      lua_pushvalue(L, 2);              /* cmd opts ... opts */
-      if (0) /*FALLTHRU*/
-    case LUA_TTABLE:
-      if (lua_value_length(L, 2) > 0)
-        return
-          luaL_error(L, "cannot specify both the args option and array values");
-      spawn_param_args(params);         /* cmd opts ... */
-      break;
+    if (i == 1) stage_in = in;
+    stage_fd[0] = stage_in;
+    stage_fd[1] = i < n ? fd[1] : out;
+    stage_fd[2] = err;
+    for (j = 0; j < 3; j++) {
+      lua_getfield(L, -1 - j, streams[j]);
+      if (!lua_isnil(L, -1)) stage_fd[j] = -1;  /* the stage has its own */
+      lua_pop(L, 1);
+      lua_pushnumber(L, stage_fd[j]);
+    }                                   /* stages pipeline spawn stage in out err */
+    if (0 != lua_pcall(L, 4, 2, 0)) {   /* stages pipeline proc/nil error */
+      if (stage_in != in) close(stage_in);
+      close_fd(&fd[0]);
+      close_fd(&fd[1]);
+      pipeline_abort(L, 2);
+      return lua_error(L);
     }
-    lua_getfield(L, 2, "env");          /* cmd opts ... envtab */
-    switch (lua_type(L, -1)) {
-    default:
-      return luaL_error(L, "bad env option (table expected, got %s)",
-                        luaL_typename(L, -1));
-    case LUA_TNIL:
-      break;
-    case LUA_TTABLE:
-      spawn_param_env(params);          /* cmd opts ... */
-      break;
+    /* the parent copies would keep the stages from ever seeing end of file */
+    if (stage_in != in) close(stage_in);
+    close_fd(&fd[1]);
+    if (lua_isnil(L, -2)) {
+      close_fd(&fd[0]);
+      pipeline_abort(L, 2);
+      return 2;
     }
-    get_redirect(L, 2, "stdin", params);    /* cmd opts ... */
-    get_redirect(L, 2, "stdout", params);   /* cmd opts ... */
-    get_redirect(L, 2, "stderr", params);   /* cmd opts ... */
+    lua_pop(L, 1);                      /* stages pipeline proc */
+    lua_rawseti(L, 2, i);               /* stages pipeline */
   }
-  return spawn_param_execute(params);   /* proc/nil error */
+  return 1;
+}
+
+/* pipeline -- exitcode.../nil error */
+int pipeline_wait(lua_State *L)
+{
+  size_t i, n;
+  luaL_checktype(L, 1, LUA_TTABLE);
+  n = lua_value_length(L, 1);
+  luaL_checkstack(L, n, "too many stages");
+  for (i = 1; i <= n; i++) {
+    struct process *p;
+    lua_rawgeti(L, 1, i);
+    p = luaL_checkudata(L, -1, PROCESS_HANDLE);
+    if (-1 == process_update(p, -1)) return push_error(L);
+    lua_pop(L, 1);
+    lua_pushnumber(L, p->status);
+  }
+  return n;
+}
+
+/* pipeline -- true/nil error */
+int pipeline_terminate(lua_State *L)
+{
+  size_t i, n;
+  luaL_checktype(L, 1, LUA_TTABLE);
+  n = lua_value_length(L, 1);
+  for (i = 1; i <= n; i++) {
+    lua_rawgeti(L, 1, i);
+    if (-1 == _process_terminate(luaL_checkudata(L, -1, PROCESS_HANDLE)))
+      return push_error(L);
+    lua_pop(L, 1);
+  }
+  lua_pushboolean(L, 1);
+  return 1;
 }
 
 #define new_dirent(L) lua_newtable(L)
@@ -559,11 +5404,15 @@ int lc_dirent(lua_State *L)
   return 1;
 }
 
+/* The pathname is kept in a table as the uservalue of the iterator, which
+ * must be a table under LuaJIT, so that it goes away with the iterator. */
+
 /* ...diriter... -- ...diriter... pathname */
 static int diriter_getpathname(lua_State *L, int index)
 {
-  lua_pushvalue(L, index);
-  lua_gettable(L, LUA_REGISTRYINDEX);
+  lua_getuserdatatable(L, index);
+  lua_rawgeti(L, -1, 1);
+  lua_replace(L, -2);
   return 1;
 }
 
@@ -572,61 +5421,167 @@ static int diriter_setpathname(lua_State *L, int index)
 {
   size_t len;
   const char *path = lua_tolstring(L, -1, &len);
+  index = absindex(L, index);
   if (path && path[len - 1] != *LUA_DIRSEP) {
     lua_pushliteral(L, LUA_DIRSEP);
     lua_concat(L, 2);
   }
-  lua_pushvalue(L, index);              /* ... pathname diriter */
-  lua_insert(L, -2);                    /* ... diriter pathname */
-  lua_settable(L, LUA_REGISTRYINDEX);   /* ... */
+  lua_createtable(L, 1, 0);             /* ... pathname t */
+  lua_insert(L, -2);                    /* ... t pathname */
+  lua_rawseti(L, -2, 1);                /* ... t */
+  lua_setuserdatatable(L, index);       /* ... */
   return 0;
 }
 
+/* State of lc_dir. Lazy iterators keep the stream open until collected,
+ * since their entries stat themselves relative to it. */
+struct diriter {
+  DIR *dir;
+  int lazy;
+};
+
 /* diriter -- diriter */
 static int diriter_close(lua_State *L)
 {
-  DIR **pd = lua_touserdata(L, 1);
-  if (*pd) {
-    closedir(*pd);
-    *pd = 0;
+  struct diriter *it = lua_touserdata(L, 1);
+  if (it->dir) {
+    closedir(it->dir);
+    it->dir = 0;
   }
-  lua_pushnil(L);
-  diriter_setpathname(L, 1);
   return 0;
 }
 
+/* diriter -- */
+int diriter_gc(lua_State *L)
+{
+  return diriter_close(L);
+}
+
 static int isdotfile(const char *name)
 {
   return name[0] == '.' && (name[1] == '\0'
          || (name[1] == '.' && name[2] == '\0'));
 }
 
-/* pathname -- iter state nil */
+/* Names the type of an entry as lc.walk does, null when not known */
+static const char *dirent_type_name(int type)
+{
+  switch (type) {
+  case DT_DIR: return "directory";
+  case DT_REG: return "file";
+  case DT_LNK: return "link";
+  case DT_UNKNOWN: return 0;
+  default: return "other";
+  }
+}
+
+/* ... -- ... type, the entries of unknown type being others */
+static void push_dirent_type(lua_State *L, int type)
+{
+  const char *name = dirent_type_name(type);
+  lua_pushstring(L, name ? name : "other");
+}
+
+/* The d_type of an entry from its lstat, for filesystems not filling it */
+static int stat_dirent_type(const struct stat *st)
+{
+  return S_ISDIR(st->st_mode) ? DT_DIR : S_ISLNK(st->st_mode) ? DT_LNK
+         : S_ISREG(st->st_mode) ? DT_REG : DT_UNKNOWN;
+}
+
+/* The fields of a lazy entry which need a stat, loaded on first use */
+/* entry key -- value */
+static int dirent_lazy_index(lua_State *L)
+{
+  struct diriter *it = lua_touserdata(L, lua_upvalueindex(1));
+  const char *key = lua_tostring(L, 2);
+  const char *name;
+  struct stat st;
+  if (!key || !it->dir
+      || (strcmp(key, "size") && strcmp(key, "mtime") && strcmp(key, "type")))
+    return 0;
+  lua_pushliteral(L, "name");
+  lua_rawget(L, 1);
+  name = lua_tostring(L, -1);
+  if (!name || -1 == fstatat(dirfd(it->dir), name, &st, AT_SYMLINK_NOFOLLOW))
+    return 0;
+  lua_pushnumber(L, st.st_size);
+  lua_setfield(L, 1, "size");
+  lua_pushnumber(L, st.st_mtime);
+  lua_setfield(L, 1, "mtime");
+  lua_pushliteral(L, "type");
+  lua_rawget(L, 1);
+  if (lua_isnil(L, -1)) {               /* d_type was not known */
+    push_dirent_type(L, stat_dirent_type(&st));
+    lua_setfield(L, 1, "type");
+  }
+  lua_settop(L, 2);
+  lua_rawget(L, 1);
+  return 1;
+}
+
+/* pathname [{stat=}] -- iter state nil */
 /* diriter ... -- entry */
 int lc_dir(lua_State *L)
 {
   const char *pathname;
-  DIR **pd;
+  struct diriter *it;
   struct dirent *d;
   switch (lua_type(L, 1)) {
   default: return luaL_error(L, "expected pathname for argument %d, got dir", 1);
   case LUA_TSTRING:
     pathname = lua_tostring(L, 1);
-    lua_pushcfunction(L, lc_dir);       /* pathname ... iter */
-    pd = lua_newuserdata(L, sizeof *pd);/* pathname ... iter state */
-    *pd = opendir(pathname);
-    if (!*pd) return push_error(L);
-    luaL_getmetatable(L, DIR_HANDLE);   /* pathname ... iter state M */
-    lua_setmetatable(L, -2);            /* pathname ... iter state */
-    lua_pushvalue(L, 1);                /* pathname ... iter state pathname */
-    diriter_setpathname(L, -2);         /* pathname ... iter state */
+    lua_settop(L, 2);
+    lua_pushcfunction(L, lc_dir);       /* pathname opts iter */
+    it = lua_newuserdata(L, sizeof *it);/* pathname opts iter state */
+    it->dir = 0;
+    it->lazy = 0;
+    if (lua_istable(L, 2)) {
+      lua_getfield(L, 2, "stat");
+      it->lazy = lua_isboolean(L, -1) && !lua_toboolean(L, -1);
+      lua_pop(L, 1);
+    }
+    luaL_getmetatable(L, DIR_HANDLE);   /* pathname opts iter state M */
+    lua_setmetatable(L, -2);            /* pathname opts iter state */
+    it->dir = opendir(pathname);
+    if (!it->dir) return push_error(L);
+    if (it->lazy) {
+      /* the metatable of the entries, its __index keeps the stream alive */
+      lua_createtable(L, 0, 1);
+      lua_pushvalue(L, -2);
+      lua_pushcclosure(L, dirent_lazy_index, 1);
+      lua_setfield(L, -2, "__index");
+      lua_setuserdatatable(L, -2);
+      return 2;
+    }
+    lua_pushvalue(L, 1);                /* pathname opts iter state pathname */
+    diriter_setpathname(L, -2);         /* pathname opts iter state */
     return 2;
   case LUA_TUSERDATA:
-    pd = luaL_checkudata(L, 1, DIR_HANDLE);
-    do d = readdir(*pd);
+    it = luaL_checkudata(L, 1, DIR_HANDLE);
+    if (!it->dir) return 0;
+    do d = readdir(it->dir);
     while (d && isdotfile(d->d_name));
-    if (!d) { diriter_close(L); return push_error(L); }
+    if (!d) {
+      if (it->lazy) return 0;
+      diriter_close(L);
+      return push_error(L);
+    }
     new_dirent(L);                      /* diriter ... entry */
+    if (it->lazy) {
+      const char *type = dirent_type_name(d->d_type);
+      lua_pushstring(L, d->d_name);
+      lua_setfield(L, -2, "name");
+      if (type) {
+        lua_pushstring(L, type);
+        lua_setfield(L, -2, "type");
+      }
+      lua_pushnumber(L, d->d_ino);
+      lua_setfield(L, -2, "ino");
+      lua_getuserdatatable(L, 1);
+      lua_setmetatable(L, -2);
+      return 1;
+    }
     diriter_getpathname(L, 1);          /* diriter ... entry dir */
     lua_pushstring(L, d->d_name);       /* diriter ... entry dir name */
     lua_pushvalue(L, -1);               /* diriter ... entry dir name name */
@@ -639,5 +5594,672 @@ int lc_dir(lua_State *L)
   /*NOTREACHED*/
 }
 
+/* Recursive traversal done in C: one descriptor and one buffer of raw
+ * entries per directory being read, the path of the current entry built in
+ * place, and the type of the entries taken from d_type so that only
+ * filesystems not filling it cost a stat. */
+
+#define WALK_BUFFER (1 << 15)
+
+#ifdef __linux__
+struct walk_dirent64 {
+  unsigned long long d_ino;
+  long long d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[1];
+};
+#endif
+
+struct walk_level {
+  int fd;
+  size_t pathlen;                       /* of the directory, no final slash */
+  int type;                             /* of its entry, a followed link too */
+  dev_t dev;                            /* only known with follow_links */
+  ino_t ino;
+#ifdef __linux__
+  char *buf;
+  long pos, len;
+#else
+  DIR *dir;
+#endif
+};
+
+struct walker {
+  int max_depth, follow, dirs_first;
+  int descend;                          /* the last directory returned */
+  char *path;
+  size_t pathsize;
+  struct walk_level *levels;
+  int nlevels, size;
+};
+
+/* Makes room for len more bytes of path */
+static int walk_grow(struct walker *w, size_t len)
+{
+  while (w->pathsize < len) {
+    size_t size = w->pathsize ? 2 * w->pathsize : 256;
+    char *path = realloc(w->path, size);
+    if (!path) return -1;
+    w->path = path;
+    w->pathsize = size;
+  }
+  return 0;
+}
+
+static void walk_pop(struct walker *w)
+{
+  struct walk_level *l = &w->levels[--w->nlevels];
+#ifdef __linux__
+  close(l->fd);
+  free(l->buf);
+#else
+  closedir(l->dir);                     /* closes l->fd too */
+#endif
+}
+
+/* Opens the directory at the end of the path, name relative to the current
+ * level, as a new level. Returns -1 if it can not be read. */
+static int walk_push(struct walker *w, const char *name, size_t pathlen)
+{
+  struct walk_level *l;
+  int fd, i;
+  if (w->nlevels == w->size) {
+    int size = w->size ? 2 * w->size : 16;
+    struct walk_level *levels = realloc(w->levels, size * sizeof *levels);
+    if (!levels) return -1;
+    w->levels = levels;
+    w->size = size;
+  }
+  fd = w->nlevels ? openat(w->levels[w->nlevels - 1].fd, name,
+                           O_RDONLY | O_DIRECTORY | O_CLOEXEC)
+       : open(name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd == -1) return -1;
+  l = &w->levels[w->nlevels];
+  l->fd = fd;
+  l->pathlen = pathlen;
+  l->type = DT_DIR;
+  l->dev = 0;
+  l->ino = 0;
+  if (w->follow) {
+    struct stat st;
+    if (-1 == fstat(fd, &st)) {
+      close(fd);
+      return -1;
+    }
+    for (i = 0; i < w->nlevels; i++)
+      if (w->levels[i].dev == st.st_dev && w->levels[i].ino == st.st_ino) {
+        close(fd);                      /* a link back to an ancestor */
+        errno = ELOOP;
+        return -1;
+      }
+    l->dev = st.st_dev;
+    l->ino = st.st_ino;
+  }
+#ifdef __linux__
+  l->buf = malloc(WALK_BUFFER);
+  l->pos = l->len = 0;
+  if (!l->buf) {
+    close(fd);
+    return -1;
+  }
+#else
+  l->dir = fdopendir(fd);
+  if (!l->dir) {
+    close(fd);
+    return -1;
+  }
+#endif
+  w->nlevels++;
+  return 0;
+}
+
+/* The next entry of the directory on top, null at its end */
+static const char *walk_entry(struct walker *w, int *type)
+{
+  struct walk_level *l = &w->levels[w->nlevels - 1];
+#ifdef __linux__
+  struct walk_dirent64 *d;
+  for (;;) {
+    if (l->pos >= l->len) {
+      l->len = syscall(SYS_getdents64, l->fd, l->buf, WALK_BUFFER);
+      l->pos = 0;
+      if (l->len <= 0) return 0;
+    }
+    d = (struct walk_dirent64 *)(l->buf + l->pos);
+    l->pos += d->d_reclen;
+    if (!isdotfile(d->d_name)) break;
+  }
+#else
+  struct dirent *d;
+  do d = readdir(l->dir);
+  while (d && isdotfile(d->d_name));
+  if (!d) return 0;
+#endif
+  *type = d->d_type;
+  return d->d_name;
+}
+
+static int walk_type(struct walker *w, const char *name, int type, int *isdir)
+{
+  int fd = w->levels[w->nlevels - 1].fd;
+  struct stat st;
+  *isdir = 0;
+  if (type == DT_UNKNOWN) {
+    if (-1 == fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW)) return DT_UNKNOWN;
+    type = stat_dirent_type(&st);
+  }
+  *isdir = type == DT_DIR;
+  if (type == DT_LNK && w->follow && 0 == fstatat(fd, name, &st, 0))
+    *isdir = S_ISDIR(st.st_mode);
+  return type;
+}
+
+/* ... -- ... path type depth */
+static int walk_push_entry(lua_State *L, struct walker *w, size_t len,
+                           int type, int depth)
+{
+  lua_pushlstring(L, w->path, len);
+  push_dirent_type(L, type);
+  lua_pushnumber(L, depth);
+  return 3;
+}
+
+/* walker -- path type depth/nil */
+static int walk_next(lua_State *L)
+{
+  struct walker *w = luaL_checkudata(L, 1, WALKER_HANDLE);
+  for (;;) {
+    const char *name;
+    size_t len, pathlen;
+    int type, isdir;
+    if (w->descend) {
+      /* the path still ends with the directory last returned */
+      struct walk_level *top = &w->levels[w->nlevels - 1];
+      w->descend = 0;
+      walk_push(w, w->path + top->pathlen + 1, strlen(w->path));
+      continue;                         /* unreadable directories are skipped */
+    }
+    if (!w->nlevels) return 0;
+    name = walk_entry(w, &type);
+    if (!name) {
+      pathlen = w->levels[w->nlevels - 1].pathlen;
+      type = w->levels[w->nlevels - 1].type;
+      walk_pop(w);
+      if (!w->nlevels) return 0;
+      if (w->dirs_first) continue;
+      w->path[pathlen] = '\0';
+      return walk_push_entry(L, w, pathlen, type, w->nlevels);
+    }
+    pathlen = w->levels[w->nlevels - 1].pathlen;
+    len = strlen(name);
+    if (-1 == walk_grow(w, pathlen + len + 2))
+      return luaL_error(L, "not enough memory");
+    w->path[pathlen] = '/';
+    memcpy(w->path + pathlen + 1, name, len + 1);
+    type = walk_type(w, name, type, &isdir);
+    len += pathlen + 1;
+    if (isdir && (w->max_depth < 0 || w->nlevels < w->max_depth)) {
+      if (w->dirs_first) {
+        w->descend = 1;
+        return walk_push_entry(L, w, len, type, w->nlevels);
+      }
+      if (0 == walk_push(w, w->path + pathlen + 1, len)) {
+        w->levels[w->nlevels - 1].type = type;
+        continue;
+      }
+    }
+    return walk_push_entry(L, w, len, type, w->nlevels);
+  }
+}
+
+/* walker -- */
+int walker_gc(lua_State *L)
+{
+  struct walker *w = luaL_checkudata(L, 1, WALKER_HANDLE);
+  while (w->nlevels) walk_pop(w);
+  free(w->levels);
+  free(w->path);
+  w->levels = 0;
+  w->path = 0;
+  w->size = 0;
+  return 0;
+}
+
+/* root [{max_depth=, follow_links=, dirs_first=}] -- iter walker nil/nil error */
+int lc_walk(lua_State *L)
+{
+  size_t len;
+  const char *root = luaL_checklstring(L, 1, &len);
+  struct walker *w;
+  lua_settop(L, 2);
+  lua_pushcfunction(L, walk_next);
+  w = lua_newuserdata(L, sizeof *w);
+  memset(w, 0, sizeof *w);
+  luaL_getmetatable(L, WALKER_HANDLE);
+  lua_setmetatable(L, -2);              /* root opts iter walker */
+  w->max_depth = -1;
+  w->dirs_first = 1;
+  if (lua_istable(L, 2)) {
+    lua_getfield(L, 2, "max_depth");
+    if (!lua_isnil(L, -1)) w->max_depth = (int)luaL_checknumber(L, -1);
+    lua_getfield(L, 2, "follow_links");
+    w->follow = lua_toboolean(L, -1);
+    lua_getfield(L, 2, "dirs_first");
+    if (!lua_isnil(L, -1)) w->dirs_first = lua_toboolean(L, -1);
+    lua_pop(L, 3);
+  }
+  if (w->max_depth == 0) return 2;
+  while (len > 1 && root[len - 1] == '/') len--;
+  if (-1 == walk_grow(w, len + 1)) return luaL_error(L, "not enough memory");
+  memcpy(w->path, root, len);
+  w->path[len] = '\0';
+  if (-1 == walk_push(w, w->path, len == 1 && *root == '/' ? 0 : len))
+    return push_error(L);
+  return 2;
+}
+
+/* Parallel traversal: every worker thread owns a deque of directories to
+ * read, works depth first at its tail and, once it runs dry, steals from
+ * the head of the others, where the biggest subtrees wait. Entries are
+ * handed to the Lua thread in batches. */
+
+#define SCAN_BATCH 512
+#define SCAN_QUEUED 64                  /* batches waiting for Lua at most */
+#define SCAN_MAX_THREADS 64
+
+enum { SCAN_SIZE, SCAN_MTIME, SCAN_MODE, SCAN_FIELDS };
+
+static const char *const scan_fields[] = { "size", "mtime", "mode", 0 };
+
+struct scan_entry {
+  size_t path;                          /* offset in names */
+  int type;
+  double stat[SCAN_FIELDS];
+};
+
+struct scan_batch {
+  struct scan_batch *next;
+  int count;
+  char *names;                          /* the zero terminated paths */
+  size_t len, size;
+  struct scan_entry e[SCAN_BATCH];
+};
+
+struct scan_deque {
+  pthread_mutex_t lock;
+  char **dirs;
+  int head, tail, size;                 /* stolen at head, owned at tail */
+};
+
+struct scan_worker {
+  struct scan *s;
+  int id;
+  pthread_t thread;
+};
+
+struct scan {
+  int nthreads, nstat, stat[SCAN_FIELDS];
+  int started;                          /* threads created, to join */
+  pthread_mutex_t lock;                 /* protects the fields below */
+  pthread_cond_t work, ready, space;
+  int pending;                          /* directories queued or being read */
+  int idle, running, stop, queued;
+  struct scan_batch *first, *last;      /* ready for the Lua thread */
+  struct scan_batch *cur;               /* being iterated by the Lua thread */
+  int pos;
+  struct scan_deque *deques;
+  struct scan_worker *workers;
+};
+
+static int scan_push(struct scan_deque *q, char *dir)
+{
+  int ret = 0;
+  pthread_mutex_lock(&q->lock);
+  if (q->tail == q->size && q->head > 0) {
+    memmove(q->dirs, q->dirs + q->head, (q->tail - q->head) * sizeof *q->dirs);
+    q->tail -= q->head;
+    q->head = 0;
+  }
+  if (q->tail == q->size) {
+    int size = q->size ? 2 * q->size : 64;
+    char **dirs = realloc(q->dirs, size * sizeof *dirs);
+    if (dirs) {
+      q->dirs = dirs;
+      q->size = size;
+    }
+  }
+  if (q->tail < q->size) q->dirs[q->tail++] = dir;
+  else ret = -1;
+  pthread_mutex_unlock(&q->lock);
+  return ret;
+}
+
+static char *scan_pop(struct scan_deque *q, int steal)
+{
+  char *dir = 0;
+  pthread_mutex_lock(&q->lock);
+  if (q->tail > q->head)
+    dir = steal ? q->dirs[q->head++] : q->dirs[--q->tail];
+  if (q->head == q->tail) q->head = q->tail = 0;
+  pthread_mutex_unlock(&q->lock);
+  return dir;
+}
+
+/* The next directory for worker id, its own or stolen */
+static char *scan_take(struct scan *s, int id)
+{
+  char *dir = scan_pop(&s->deques[id], 0);
+  int i;
+  for (i = 1; !dir && i < s->nthreads; i++)
+    dir = scan_pop(&s->deques[(id + i) % s->nthreads], 1);
+  return dir;
+}
+
+/* Queues a directory on the deque of worker id, waking an idle worker */
+static void scan_queue(struct scan *s, int id, char *dir)
+{
+  pthread_mutex_lock(&s->lock);
+  s->pending++;
+  pthread_mutex_unlock(&s->lock);
+  if (-1 == scan_push(&s->deques[id], dir)) {
+    free(dir);
+    pthread_mutex_lock(&s->lock);
+    s->pending--;
+    pthread_mutex_unlock(&s->lock);
+    return;
+  }
+  pthread_mutex_lock(&s->lock);
+  if (s->idle) pthread_cond_signal(&s->work);
+  pthread_mutex_unlock(&s->lock);
+}
+
+/* Hands the batch to the Lua thread, waiting while too many are queued */
+static void scan_flush(struct scan *s, struct scan_batch **pb)
+{
+  struct scan_batch *b = *pb;
+  *pb = 0;
+  if (!b) return;
+  pthread_mutex_lock(&s->lock);
+  while (s->queued >= SCAN_QUEUED && !s->stop)
+    pthread_cond_wait(&s->space, &s->lock);
+  if (s->stop) {
+    pthread_mutex_unlock(&s->lock);
+    free(b->names);
+    free(b);
+    return;
+  }
+  b->next = 0;
+  if (s->last) s->last->next = b;
+  else s->first = b;
+  s->last = b;
+  s->queued++;
+  pthread_cond_signal(&s->ready);
+  pthread_mutex_unlock(&s->lock);
+}
+
+/* Adds an entry to the batch of the worker, returns -1 out of memory */
+static int scan_add(struct scan *s, struct scan_batch **pb, const char *dir,
+                    size_t dirlen, const char *name, int type,
+                    const struct stat *st)
+{
+  struct scan_batch *b = *pb;
+  struct scan_entry *e;
+  size_t len = dirlen + strlen(name) + 2;
+  if (b && b->count == SCAN_BATCH) scan_flush(s, pb);
+  if (!*pb) {
+    if (!(b = *pb = malloc(sizeof *b))) return -1;
+    b->count = 0;
+    b->names = 0;
+    b->len = b->size = 0;
+  }
+  while (b->size - b->len < len) {
+    size_t size = b->size ? 2 * b->size : 16384;
+    char *names = realloc(b->names, size);
+    if (!names) return -1;
+    b->names = names;
+    b->size = size;
+  }
+  e = &b->e[b->count++];
+  e->path = b->len;
+  e->type = type;
+  memcpy(b->names + b->len, dir, dirlen);
+  b->names[b->len + dirlen] = '/';
+  memcpy(b->names + b->len + dirlen + 1, name, len - dirlen - 1);
+  b->len += len;
+  if (st) {
+    e->stat[SCAN_SIZE] = st->st_size;
+    e->stat[SCAN_MTIME] = st->st_mtime;
+    e->stat[SCAN_MODE] = st->st_mode & 07777;
+  }
+  return 0;
+}
+
+/* Reads the directory, queueing its subdirectories */
+static void scan_read(struct scan *s, int id, const char *dir,
+                      struct scan_batch **pb)
+{
+  DIR *d = opendir(dir);
+  struct dirent *ent;
+  size_t dirlen = strlen(dir);
+  if (!d) return;                       /* unreadable directories are skipped */
+  if (dirlen == 1 && *dir == '/') dirlen = 0;
+  while (!__atomic_load_n(&s->stop, __ATOMIC_RELAXED) && (ent = readdir(d))) {
+    struct stat st;
+    int type = ent->d_type, have = 0;
+    if (isdotfile(ent->d_name)) continue;
+    if (s->nstat || type == DT_UNKNOWN) {
+      have = 0 == fstatat(dirfd(d), ent->d_name, &st, AT_SYMLINK_NOFOLLOW);
+      if (have && type == DT_UNKNOWN) type = stat_dirent_type(&st);
+    }
+    if (!have) memset(&st, 0, sizeof st);
+    if (-1 == scan_add(s, pb, dir, dirlen, ent->d_name, type, &st)) break;
+    if (type == DT_DIR) {
+      struct scan_batch *b = *pb;
+      char *sub = strdup(b->names + b->e[b->count - 1].path);
+      if (sub) scan_queue(s, id, sub);
+    }
+  }
+  closedir(d);
+}
+
+static void *scan_work(void *arg)
+{
+  struct scan_worker *w = arg;
+  struct scan *s = w->s;
+  struct scan_batch *b = 0;
+  for (;;) {
+    char *dir = __atomic_load_n(&s->stop, __ATOMIC_RELAXED) ? 0
+                : scan_take(s, w->id);
+    if (!dir) {
+      scan_flush(s, &b);
+      pthread_mutex_lock(&s->lock);
+      /* looked for again under the lock, which scan_queue takes to signal
+       * after pushing, so that no directory is queued unseen before the wait */
+      while (!s->stop && s->pending && !(dir = scan_take(s, w->id))) {
+        s->idle++;
+        pthread_cond_wait(&s->work, &s->lock);
+        s->idle--;
+      }
+      pthread_mutex_unlock(&s->lock);
+      if (!dir) break;
+    }
+    scan_read(s, w->id, dir, &b);
+    free(dir);
+    pthread_mutex_lock(&s->lock);
+    if (--s->pending == 0) pthread_cond_broadcast(&s->work);
+    pthread_mutex_unlock(&s->lock);
+  }
+  scan_flush(s, &b);
+  pthread_mutex_lock(&s->lock);
+  s->running--;
+  pthread_cond_signal(&s->ready);
+  pthread_mutex_unlock(&s->lock);
+  return 0;
+}
+
+static void scan_free_batches(struct scan_batch *b)
+{
+  while (b) {
+    struct scan_batch *next = b->next;
+    free(b->names);
+    free(b);
+    b = next;
+  }
+}
+
+/* Stops and joins the workers */
+/* scan -- */
+int scan_gc(lua_State *L)
+{
+  struct scan *s = luaL_checkudata(L, 1, SCAN_HANDLE);
+  int i;
+  if (!s->workers) return 0;
+  pthread_mutex_lock(&s->lock);
+  s->stop = 1;
+  pthread_cond_broadcast(&s->work);
+  pthread_cond_broadcast(&s->space);
+  pthread_mutex_unlock(&s->lock);
+  for (i = 0; i < s->started; i++)
+    pthread_join(s->workers[i].thread, 0);
+  for (i = 0; i < s->nthreads; i++) {
+    struct scan_deque *q = &s->deques[i];
+    while (q->tail > q->head) free(q->dirs[--q->tail]);
+    free(q->dirs);
+    pthread_mutex_destroy(&q->lock);
+  }
+  scan_free_batches(s->first);
+  scan_free_batches(s->cur);
+  free(s->deques);
+  free(s->workers);
+  s->workers = 0;
+  s->first = s->last = s->cur = 0;
+  pthread_cond_destroy(&s->work);
+  pthread_cond_destroy(&s->ready);
+  pthread_cond_destroy(&s->space);
+  pthread_mutex_destroy(&s->lock);
+  return 0;
+}
+
+/* scan -- path type [stat...]/nil */
+static int scan_next(lua_State *L)
+{
+  struct scan *s = luaL_checkudata(L, 1, SCAN_HANDLE);
+  struct scan_entry *e;
+  int i;
+  while (!s->cur || s->pos == s->cur->count) {
+    struct scan_batch *b;
+    scan_free_batches(s->cur);
+    s->cur = 0;
+    if (!s->workers) return 0;
+    pthread_mutex_lock(&s->lock);
+    while (!s->first && s->running)
+      pthread_cond_wait(&s->ready, &s->lock);
+    b = s->first;
+    if (b) {
+      s->first = b->next;
+      if (!s->first) s->last = 0;
+      b->next = 0;
+      s->queued--;
+      pthread_cond_signal(&s->space);
+    }
+    pthread_mutex_unlock(&s->lock);
+    if (!b) return 0;
+    s->cur = b;
+    s->pos = 0;
+  }
+  e = &s->cur->e[s->pos++];
+  lua_pushstring(L, s->cur->names + e->path);
+  push_dirent_type(L, e->type);
+  for (i = 0; i < s->nstat; i++)
+    lua_pushnumber(L, e->stat[s->stat[i]]);
+  return 2 + s->nstat;
+}
+
+/* root [{threads=, stat={field...}}] -- iter scan/nil error */
+int lc_scan(lua_State *L)
+{
+  size_t len;
+  const char *root = luaL_checklstring(L, 1, &len);
+  struct scan *s;
+  struct stat st;
+  char *dir;
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  int i, err;
+  lua_settop(L, 2);
+  if (lua_istable(L, 2)) {
+    lua_getfield(L, 2, "threads");
+    if (!lua_isnil(L, -1)) n = (long)luaL_checknumber(L, -1);
+    lua_pop(L, 1);
+  }
+  if (n < 1) n = 1;
+  if (n > SCAN_MAX_THREADS) n = SCAN_MAX_THREADS;
+  if (-1 == stat(root, &st)) return push_error(L);
+  if (!S_ISDIR(st.st_mode)) {
+    errno = ENOTDIR;
+    return push_error(L);
+  }
+  lua_pushcfunction(L, scan_next);
+  s = lua_newuserdata(L, sizeof *s);
+  memset(s, 0, sizeof *s);
+  if (lua_istable(L, 2)) {
+    lua_getfield(L, 2, "stat");
+    if (!lua_isnil(L, -1)) {
+      luaL_checktype(L, -1, LUA_TTABLE);
+      s->nstat = (int)lua_value_length(L, -1);
+      if (s->nstat > SCAN_FIELDS)
+        return luaL_error(L, "bad stat option (at most %d fields)", SCAN_FIELDS);
+      for (i = 0; i < s->nstat; i++) {
+        lua_rawgeti(L, -1, i + 1);
+        s->stat[i] = luaL_checkoption(L, -1, 0, scan_fields);
+        lua_pop(L, 1);
+      }
+    }
+    lua_pop(L, 1);
+  }
+  while (len > 1 && root[len - 1] == '/') len--;
+  s->nthreads = (int)n;
+  s->deques = calloc(n, sizeof *s->deques);
+  s->workers = calloc(n, sizeof *s->workers);
+  dir = malloc(len + 1);
+  if (!s->deques || !s->workers || !dir) {
+    free(s->deques);
+    free(s->workers);
+    free(dir);
+    s->workers = 0;
+    return luaL_error(L, "not enough memory");
+  }
+  memcpy(dir, root, len);
+  dir[len] = '\0';
+  pthread_mutex_init(&s->lock, 0);
+  pthread_cond_init(&s->work, 0);
+  pthread_cond_init(&s->ready, 0);
+  pthread_cond_init(&s->space, 0);
+  for (i = 0; i < n; i++)
+    pthread_mutex_init(&s->deques[i].lock, 0);
+  luaL_getmetatable(L, SCAN_HANDLE);
+  lua_setmetatable(L, -2);              /* root opts iter scan */
+  scan_queue(s, 0, dir);
+  /* nthreads stays n, the deques of the threads not created remain empty */
+  for (i = 0; i < n; i++) {
+    s->workers[i].s = s;
+    s->workers[i].id = i;
+    pthread_mutex_lock(&s->lock);
+    s->running++;
+    pthread_mutex_unlock(&s->lock);
+    err = pthread_create(&s->workers[i].thread, 0, scan_work, &s->workers[i]);
+    if (err) {
+      errno = err;
+      pthread_mutex_lock(&s->lock);
+      s->running--;
+      pthread_mutex_unlock(&s->lock);
+      break;
+    }
+    s->started++;
+  }
+  if (!s->started) return push_error(L); /* scan_gc frees the root */
+  return 2;
+}
+
 #endif // USE_POSIX
 
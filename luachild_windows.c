@@ -101,6 +101,53 @@ int lc_setenv(lua_State *L)
   return 1;
 }
 
+/* {name=value/false...} -- true/nil error */
+int lc_setenv_many(lua_State *L)
+{
+  luaL_checktype(L, 1, LUA_TTABLE);
+  lua_settop(L, 1);
+  lua_pushnil(L);
+  while (lua_next(L, 1)) {              /* tbl k v */
+    const char *nam, *val;
+    if (lua_type(L, -2) != LUA_TSTRING)
+      return luaL_error(L, "expected string for environment variable name, got %s",
+                        luaL_typename(L, -2));
+    nam = lua_tostring(L, -2);
+    val = lua_type(L, -1) == LUA_TBOOLEAN ? 0 : lua_tostring(L, -1);
+    if (!val && lua_toboolean(L, -1))
+      return luaL_error(L, "expected string or false for environment variable value, got %s",
+                        luaL_typename(L, -1));
+    if (!SetEnvironmentVariable(nam, val))
+      return push_error(L);
+    lua_pop(L, 1);                      /* tbl k */
+  }
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+/* name -- value/nil */
+int lc_getenv(lua_State *L)
+{
+  const char *nam = luaL_checkstring(L, 1);
+  char buffer[1024];
+  DWORD len = GetEnvironmentVariable(nam, buffer, sizeof buffer);
+  if (len == 0) {
+    if (GetLastError() == ERROR_ENVVAR_NOT_FOUND) lua_pushnil(L);
+    else lua_pushliteral(L, "");
+  }
+  else if (len < sizeof buffer) {
+    lua_pushlstring(L, buffer, len);
+  }
+  else {
+    char *big = malloc(len);
+    if (!big) return luaL_error(L, "not enough memory");
+    len = GetEnvironmentVariable(nam, big, len);
+    lua_pushlstring(L, big, len);
+    free(big);
+  }
+  return 1;
+}
+
 /* -- environment-table */
 int lc_environ(lua_State *L)
 {
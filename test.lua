@@ -68,6 +68,15 @@ got = lc.environ()['TESTVAR']
 
 test(nil, got)
 
+lc.setenv_many{TESTVAR='one', TESTVAR2='two'}
+test('one', lc.getenv('TESTVAR'))
+got = lc.environ()
+test('two', got.TESTVAR2)
+test(got, lc.environ())
+lc.setenv_many{TESTVAR=false, TESTVAR2=false}
+test(nil, lc.getenv('TESTVAR2'))
+test(nil, lc.environ().TESTVAR)
+
 -- Pipe
 
 expect = 'hello world ' .. tostring(math.random())
@@ -88,6 +97,23 @@ got = r:read("*l")
 
 test(expect, got)
 
+-- Pipe options
+
+expect = 'hello world ' .. tostring(math.random())
+
+local r,w = lc.pipe{buffering='line', size=1048576}
+w:write(expect)
+w:close()
+got = r:read('*a')
+
+test(expect, got)
+test(false, pcall(lc.pipe, {buffering='bogus'}))
+test(false, pcall(lc.pipe, {buffering=-1}))
+test(false, pcall(lc.pipe, {size=0}))
+test(false, pcall(lc.pipe, {size=-4096}))
+test(false, pcall(lc.pipe, {size='big'}))
+test(false, pcall(lc.pipe, {size=2^40}))
+
 -- Spawn
 
 expect = 'hello world ' .. tostring(math.random())
@@ -136,6 +162,40 @@ got = r:read("*l")
 
 test(expect:gsub('[\n\r]*$',''), got:gsub('[\n\r]*$',''))
 
+-- Environment block
+
+if lc.envblock then
+  local block = lc.envblock(lc.environ())
+  local variant = block:with{TESTVAR='from block', HOME=false}
+  test(nil, variant:totable().HOME)
+  test('from block', variant:totable().TESTVAR)
+  test(#block, #variant + (os.getenv('HOME') and 1 or 0))
+  local r,w = lc.pipe()
+  local p=lc.spawn{lua,'-e','print(os.getenv("TESTVAR"), os.getenv("HOME"))', stdout=w, env=variant}
+  w:close()
+  p:wait()
+  test('from block\tnil', r:read("*l"))
+  r:close()
+end
+
+-- Environment overlay
+
+lc.setenv('TESTVAR', 'unchanged')
+lc.setenv('TESTVAR2', 'removed')
+local r,w = lc.pipe()
+local p=lc.spawn{lua,'-e','print(os.getenv("TESTVAR"), os.getenv("TESTVAR2"), os.getenv("TESTVAR3"))', stdout=w, env_set={TESTVAR3='added'}, env_unset={'TESTVAR2'}}
+w:close()
+p:wait()
+test('unchanged\tnil\tadded', r:read("*l"))
+r:close()
+local r,w = lc.pipe()
+local p=lc.spawn{lua,'-e','print(os.getenv("TESTVAR"), os.getenv("TESTVAR3"))', stdout=w, env_clear=true, env_set={TESTVAR3='alone', PATH=os.getenv('PATH'), LD_LIBRARY_PATH=os.getenv('LD_LIBRARY_PATH')}}
+w:close()
+p:wait()
+test('nil\talone', r:read("*l"))
+r:close()
+test('removed', lc.environ().TESTVAR2)
+
 -- Sub-process result
 
 local function readall()
@@ -156,6 +216,640 @@ local result = p:wait()
 
 test(result, 123)
 
+-- Command
+
+if lc.command then
+  local r,w = lc.pipe()
+  local args = {lua,'-e','io.write("a")', stdout=w}
+  local c = lc.command(args)
+  test(lua, args[1])
+  test(0, c:spawn():wait())
+  test(0, c:spawn('-e', 'io.write("b;")'):wait())
+  test(3, c:spawn('-e', 'os.exit(3)'):wait())
+  w:close()
+  test('aab;a', r:read('*a'))
+  r:close()
+  r, w = lc.pipe()
+  args = {'echo', 'hello'..'world', 12345, stdout=w}
+  c = lc.command(args)
+  args[2], args[3], args.stdout, w = nil, nil, nil, nil
+  for i = 1, 1000 do args[i] = 'junk'..i end
+  collectgarbage()
+  collectgarbage()
+  test(0, c:spawn():wait())
+  c = nil
+  collectgarbage()
+  test('helloworld 12345', r:read('*l'))
+  r:close()
+end
+
+-- Which
+
+if lc.which then
+  local sh = lc.which('sh')
+  test('/', sh:sub(1,1))
+  test(sh, lc.which('sh'))
+  test(nil, lc.which('luachild-no-such-command'))
+  local p = lc.spawn{'sh', '-c', 'exit 4'}
+  test(4, p:wait())
+end
+
+-- Spawn backends
+
+if lc.backend then
+  local default = lc.backend()
+  for _, name in ipairs{'posix', 'vfork', 'fork'} do
+    if lc.backend(name) then
+      local r,w = lc.pipe()
+      local p = lc.spawn{lua,'-e','io.write("'..name..'") os.exit(2)', stdout=w}
+      w:close()
+      test(name, r:read('*a'))
+      r:close()
+      test(2, p:wait())
+      local p, err = lc.spawn{'luachild-no-such-command'}
+      test(nil, p)
+      test('string', type(err))
+    end
+  end
+  test(nil, lc.backend('no-such-backend'))
+  test(default, lc.backend('default'))
+end
+
+-- Descriptor mapping
+
+-- where the option is supported, a bad value is refused
+if not pcall(lc.spawn, {'sh', fds=true}) then
+  local r1,w1 = lc.pipe()
+  local r2,w2 = lc.pipe()
+  local code = 'for i = 3, 4 do local f = io.open("/dev/fd/"..i, "w") f:write(i) f:close() end'
+  local p = lc.spawn{lua,'-e',code, fds={[3]=w1, [4]=w2}, close_fds=true}
+  test(0, p:wait())
+  local p = lc.spawn{lua,'-e',code, fds={[3]=w2, [4]=w1}, close_fds=true}
+  test(0, p:wait())
+  w1:close()
+  w2:close()
+  test('34', r1:read('*a'))
+  test('43', r2:read('*a'))
+  r1:close()
+  r2:close()
+
+  -- the stdout redirect replaces a descriptor the fds option reads, in a
+  -- child whose stdout is captured
+  local inner = ([[
+    local lc = require 'luachild'
+    local r,w = lc.pipe()
+    local code = 'io.write("o") io.stdout:flush() local f = io.open("/dev/fd/3", "w") f:write("x") f:close()'
+    local c = lc.command{%q,'-e',code, stdout=w, fds={[3]=io.stdout}}
+    c:spawn():wait()
+    c:spawn():wait()
+    w:close()
+    io.stderr:write(r:read('*a'))
+  ]]):format(lua)
+  local res = lc.run{lua,'-e',inner}
+  test('xx', res.stdout)
+  test('oo', res.stderr)
+
+  -- a plain io.open descriptor is inherited, unlike the ones of lc.pipe
+  if lc.spawn{'test', '-d', '/proc/self/fd'}:wait() == 0 then
+    local name = os.tmpname()
+    local f = io.open(name, 'w')
+    local count = ('ls -l /proc/self/fd/ | grep -c %q'):format(name)
+    local res = lc.run{'sh', '-c', count}
+    test('1', res.stdout:match('%d+'))
+    res = lc.run{'sh', '-c', count, fds={[3]=io.stdout, [4]=io.stderr}, close_fds=true}
+    test('0', res.stdout:match('%d+'))
+    -- only 0 to 4 are left, and 5 for the directory ls reads
+    res = lc.run{'ls', '/proc/self/fd/', fds={[3]=io.stdout, [4]=io.stderr}, close_fds=true}
+    local fds = {}
+    for fd in res.stdout:gmatch('%d+') do fds[#fds + 1] = fd end
+    test('0 1 2 3 4 5', table.concat(fds, ' '))
+    f:close()
+    os.remove(name)
+  end
+end
+
+-- Process groups
+
+if lc.backend and not pcall(lc.spawn, {'sh', pgroup='leader'}) then
+  for _, name in ipairs{'posix', 'vfork', 'fork'} do
+    if lc.backend(name) then
+      local r,w = lc.pipe()
+      local p = lc.spawn{'sh', '-c', 'sleep 30 & echo started; wait', stdout=w, pgroup=true, sigmask={'USR1'}}
+      w:close()
+      test('started', r:read('*l'))
+      test(true, p:terminate{group=true, signal='KILL'})
+      test('', r:read('*a'))
+      r:close()
+      test('number', type(p:wait(5)))
+      local p = lc.spawn{'sh', '-c', 'exit', setsid=true, sigdefault=true}
+      test(0, p:wait())
+    end
+  end
+  lc.backend('default')
+  local p = lc.spawn{'sh', '-c', 'exit'}
+  test(nil, p:terminate{group=true})
+  test(false, pcall(p.terminate, p, {signal='NOPE'}))
+  p:wait()
+end
+
+-- Resource limits
+
+if not pcall(lc.spawn, {'sh', rlimits={nothing=1}}) then
+  local r,w = lc.pipe()
+  local p = lc.spawn{'sh', '-c', 'ulimit -n; ulimit -t', stdout=w, rlimits={nofile=64, cpu={100, 200}}, nice=5}
+  w:close()
+  test('64', r:read('*l'))
+  test('100', r:read('*l'))
+  r:close()
+  test(0, p:wait())
+  -- the descriptors are mapped before the limit applies
+  local r,w = lc.pipe()
+  local code = 'local f = io.open("/dev/fd/100", "w") f:write("mapped\\n") f:close()'
+  local p = lc.spawn{lua, '-e', code, fds={[100]=w}, rlimits={nofile=64}}
+  w:close()
+  test('mapped', r:read('*l'))
+  r:close()
+  test(0, p:wait())
+  -- run on one of the CPUs this process may use, not necessarily CPU 0
+  local f = io.open('/proc/self/status')
+  local cpu = f and tonumber(f:read('*a'):match('Cpus_allowed_list:%s*(%d+)'))
+  if f then f:close() end
+  if cpu and lc.which('nproc') then
+    local r,w = lc.pipe()
+    local p = lc.spawn{'nproc', stdout=w, cpus={cpu}, ioprio='idle'}
+    w:close()
+    test('1', r:read('*l'))
+    r:close()
+    test(0, p:wait())
+  end
+  if lc.backend and lc.backend('posix') then
+    local p, err = lc.spawn{'sh', '-c', 'exit', nice=1}
+    test(nil, p)
+    test('string', type(err))
+    lc.backend('default')
+  end
+  test(false, pcall(lc.spawn, {'sh', rlimits={nothing=1}}))
+end
+
+-- Process result
+
+local p = lc.spawn{'sh', '-c', 'exit 7'}
+if p.result then
+  local res = p:result()
+  test(7, res.code)
+  test(nil, res.signal)
+  test('number', type(res.utime))
+  test('number', type(res.maxrss))
+  test(true, res.wall >= 0)
+  local p = lc.spawn{'sh', '-c', 'kill -KILL $$'}
+  test(137, p:wait())
+  test(9, p:result().signal)
+  local res = lc.run{'sh', '-c', 'kill -TERM $$'}
+  test(15, res.signal)
+else
+  p:wait()
+end
+
+-- Worker pool
+
+if lc.pool then
+  local worker = [[
+    while true do
+      local n = io.read('*l')
+      if not n then break end
+      local s = n == '0' and '' or io.read(tonumber(n))
+      if s == 'crash' then os.exit(3) end
+      if s == 'garbage' then io.write('oops\n') io.flush() end
+      if s == 'bye' then io.write('3\nBYE') io.flush() os.exit(0) end
+      s = s:upper()
+      io.write(#s, '\n', s)
+      io.flush()
+    end
+  ]]
+  local pool = lc.pool{cmd={lua, '-e', worker}, size=2}
+  test('ABC', pool:call('abc'))
+  test('', pool:call(''))
+  local big = string.rep('x', 200000)
+  test(big:upper(), pool:call(big))
+  local ids = {}
+  for i = 1, 5 do ids[pool:submit('r'..i)] = 'R'..i end
+  for i = 1, 5 do
+    local id, res = pool:collect()
+    test(ids[id], res)
+    ids[id] = nil
+  end
+  test(nil, next(ids))
+  test(nil, pool:collect())
+  local res, err = pool:call('crash')
+  test(nil, res)
+  test('worker exited with code 3', err)
+  test('AGAIN', pool:call('again'))
+  local res, err = pool:call('garbage')
+  test(nil, res)
+  test('string', type(err))
+  test('AFTER', pool:call('after'))
+  -- a worker that died while idle is restarted before it gets a request
+  test('BYE', pool:call('bye'))
+  test('BYE', pool:call('bye'))
+  local ids = {}
+  for i = 1, 4 do ids[pool:submit('s'..i)] = 'S'..i end
+  for i = 1, 4 do
+    local id, res = pool:collect()
+    test(ids[id], res)
+  end
+  test(true, pool:close())
+  pool = lc.pool{cmd={lua, '-e', worker}, size=2}
+  pool = nil
+  collectgarbage()
+  collectgarbage()
+end
+
+-- Fork server
+
+if lc.forkserver then
+  local fs = lc.forkserver('greeting = "hi"', {'string'})
+  local r, w = lc.pipe()
+  local c = fs:spawn{lua=function(a, b) io.write(greeting, a, b) return 5 end,
+                     'x', 'y', stdout=w}
+  w:close()
+  test('hixy', r:read('*a'))
+  r:close()
+  test(5, c:wait())
+  test(true, c:pid() > 0)
+  r, w = lc.pipe()
+  c = fs:spawn{lua, '-e', 'io.write("exec")', stdout=w}
+  w:close()
+  test('exec', r:read('*a'))
+  r:close()
+  test(0, c:wait())
+  r, w = lc.pipe()
+  c = fs:spawn{lua='error("boom", 0)', stderr=w}
+  w:close()
+  test('boom\n', r:read('*a'))
+  r:close()
+  test(1, c:wait())
+  c = fs:spawn{lua=[[ while true do end ]]}
+  test(true, c:wait(0.05))
+  test(true, c:terminate())
+  test(128 + 15, c:wait())
+  if debug.getuservalue then
+    c = fs:spawn{lua='return 2'}
+    c = nil
+    collectgarbage()
+    test(3, fs:spawn{lua='return 3'}:wait())
+    collectgarbage()
+    test(nil, next(debug.getuservalue(fs)))
+  end
+  test(true, fs:close())
+  test(nil, (lc.forkserver('error("x")', nil)))
+end
+
+-- Async
+
+if lc.async then
+  local got = {}
+  local r1, w1 = lc.pipe()
+  local r2, w2 = lc.pipe()
+  local p = lc.spawn{lua, '-e', 'io.write(io.read("*a"):upper())', stdin=r1, stdout=w2}
+  r1:close()
+  w2:close()
+  coroutine.wrap(function()
+    test(true, lc.async.write(w1, string.rep('a', 100000)))
+    w1:close()
+  end)()
+  coroutine.wrap(function()
+    got.out = lc.async.read(r2, 'a')
+    r2:close()
+    got.code = lc.async.wait(p)
+  end)()
+  coroutine.wrap(function()
+    got.run = lc.async.run{lua, '-e', 'io.write(io.read("*a"), "!") os.exit(2)', input='hi'}
+  end)()
+  test(nil, got.code)
+  test(true, lc.loop())
+  test(string.rep('A', 100000), got.out)
+  test(0, got.code)
+  test('hi!', got.run.stdout)
+  test(2, got.run.code)
+  local r, w = lc.pipe()
+  coroutine.wrap(function() got.chunk = lc.async.read(r, 3) end)()
+  test(false, lc.loop(0.05))
+  w:write('abcdef')
+  w:close()
+  test(true, lc.loop())
+  test('abc', got.chunk)
+  r:close()
+  test(false, pcall(lc.async.read, io.stdin))
+  r, w = lc.pipe()
+  coroutine.wrap(function()
+    got.zero = pcall(lc.async.read, r, 0)
+    got.negative = pcall(lc.async.read, r, -1)
+  end)()
+  test(false, got.zero)
+  test(false, got.negative)
+  test(true, lc.loop(1))
+  r:close()
+  w:close()
+end
+
+-- Walk
+
+if lc.walk then
+  test(0, lc.spawn{'sh', '-c', 'rm -rf walk.d && mkdir -p walk.d/a/b && touch walk.d/a/b/f walk.d/g && ln -s a walk.d/l'}:wait())
+  local function collect(opts)
+    local seen = {}
+    for path, type, depth in lc.walk('walk.d/', opts) do
+      seen[#seen + 1] = ('%s:%s:%d'):format(path, type, depth)
+    end
+    return seen
+  end
+  local seen = collect()
+  table.sort(seen)
+  test('walk.d/a/b/f:file:3 walk.d/a/b:directory:2 walk.d/a:directory:1 walk.d/g:file:1 walk.d/l:link:1',
+       table.concat(seen, ' '))
+  seen = collect{dirs_first=false}
+  local pos = {}
+  for i, e in ipairs(seen) do pos[e:match('^[^:]*')] = i end
+  test(true, pos['walk.d/a/b/f'] < pos['walk.d/a/b'] and pos['walk.d/a/b'] < pos['walk.d/a'])
+  test(3, #collect{max_depth=1})
+  test(7, #collect{follow_links=true})
+  for _, dirs_first in ipairs{true, false} do
+    seen = collect{follow_links=true, dirs_first=dirs_first}
+    table.sort(seen)
+    test('walk.d/l/b/f:file:3 walk.d/l/b:directory:2 walk.d/l:link:1',
+         table.concat(seen, ' ', 5, 7))
+  end
+  test(nil, (lc.walk('walk.d/nope')))
+  lc.spawn{'rm', '-rf', 'walk.d'}:wait()
+end
+
+-- Lazy directory entries
+
+local lazy_dir = false
+for e in lc.dir('/', {stat=false}) do lazy_dir = rawget(e, 'size') == nil break end
+if lazy_dir then
+  test(0, lc.spawn{'sh', '-c', 'rm -rf dir.d && mkdir -p dir.d/sub && printf 12345 > dir.d/f && ln -s f dir.d/l'}:wait())
+  local seen = {}
+  for e in lc.dir('dir.d', {stat=false}) do seen[e.name] = e end
+  test('directory', seen.sub.type)
+  test('file', seen.f.type)
+  test(true, seen.f.ino > 0)
+  test(nil, rawget(seen.f, 'size'))
+  test(5, seen.f.size)
+  test(true, seen.f.mtime > 0)
+  test('link', seen.l.type)
+  test(1, seen.l.size)
+  local n = 0
+  for e in lc.dir('dir.d') do n = n + 1 test(true, e.size ~= nil) end
+  test(3, n)
+  local function fds()
+    local n = 0
+    for _ in lc.dir('/proc/self/fd', {stat=false}) do n = n + 1 end
+    return n
+  end
+  if pcall(fds) then
+    collectgarbage()
+    n = fds()
+    for i = 1, 20 do
+      for e in lc.dir('dir.d') do break end
+    end
+    collectgarbage()
+    collectgarbage()
+    test(n, fds())
+  end
+  lc.spawn{'rm', '-rf', 'dir.d'}:wait()
+end
+
+-- Parallel scan
+
+if lc.scan then
+  test(0, lc.spawn{'sh', '-c', 'rm -rf scan.d && mkdir -p scan.d/a/b scan.d/c && printf 123 > scan.d/a/b/f && touch scan.d/c/g scan.d/h'}:wait())
+  for _, threads in ipairs{1, 3} do
+    local seen = {}
+    for path, type, size, mode in lc.scan('scan.d', {threads=threads, stat={'size', 'mode'}}) do
+      seen[path] = ('%s:%d'):format(type, size)
+      test(true, mode > 0)
+    end
+    test('file:3', seen['scan.d/a/b/f'])
+    test('file:0', seen['scan.d/c/g'])
+    test(true, seen['scan.d/a'] ~= nil and seen['scan.d/h'] ~= nil)
+    local n = 0
+    for _ in pairs(seen) do n = n + 1 end
+    test(6, n)
+  end
+  for path in lc.scan('scan.d') do break end
+  collectgarbage()
+  test(nil, (lc.scan('scan.d/h')))
+  lc.spawn{'rm', '-rf', 'scan.d'}:wait()
+end
+
+-- Timed wait
+
+local r,w = lc.pipe()
+local p=lc.spawn{lua,'-e','io.read()',stdin=r}
+r:close()
+test(true, p:wait(0.05))
+test(true, p:wait(false))
+local fd = p:fileno()
+local linux = lc.procset()
+if linux then
+  -- process handles are backed by a pidfd there
+  linux:close()
+  test('number', type(fd))
+  test(true, fd > 2)
+else
+  test(nil, fd)
+end
+w:close()
+test(0, p:wait(10))
+
+-- Process set
+
+local set = lc.procset()
+if set then
+  local r,w = lc.pipe()
+  local p1=lc.spawn{lua,'-e','os.exit(3)'}
+  local p2=lc.spawn{lua,'-e','io.read() os.exit(4)',stdin=r}
+  r:close()
+  set:add(p1)
+  set:add(p2)
+  local done = {}
+  while not done[p1] do
+    for p,code in pairs(set:wait(10)) do done[p] = code end
+  end
+  test(3, done[p1])
+  test(nil, done[p2])
+  w:close()
+  while not done[p2] do
+    for p,code in pairs(set:wait(10)) do done[p] = code end
+  end
+  test(4, done[p2])
+  test(nil, next(set:wait(0)))
+  test(nil, next(set:wait(0.1)))
+  set:close()
+end
+
+-- Collecting a running process
+
+if lc.children then
+  local function alive(pid)
+    for _,c in ipairs(lc.children()) do
+      if c == pid then return true end
+    end
+    return false
+  end
+  local r,w = lc.pipe()
+  local p=lc.spawn{lua,'-e','io.read()',stdin=r}
+  local pid = tonumber(tostring(p):match('%d+'))
+  test(true, alive(pid))
+  p = nil
+  collectgarbage()
+  collectgarbage()
+  local R,W = lc.pipe()
+  local nap = lc.spawn{lua,'-e','io.read()',stdin=R}
+  for i = 1, 100 do
+    if not alive(pid) then break end
+    nap:wait(0.05)
+  end
+  test(false, alive(pid))
+  test(143, lc.reaped()[pid])
+  test(nil, next(lc.reaped()))
+  W:close()
+  nap:wait()
+  w:close()
+end
+
+-- Splice and tee
+
+if lc.splice then
+  expect = 'hello world ' .. tostring(math.random())
+  local r,w = lc.pipe()
+  w:write(expect)
+  w:close()
+  local f = io.open('tmp.out.txt','wb')
+  test(#expect, lc.splice(r, f))
+  f:close()
+  r:close()
+  test(expect, readall())
+
+  local r,w = lc.pipe()
+  local R,W = lc.pipe()
+  w:write(expect)
+  w:close()
+  local f = io.open('tmp.out.txt','wb')
+  test(#expect, lc.tee(r, W, f))
+  W:close()
+  f:close()
+  r:close()
+  test(expect, R:read('*a'))
+  test(expect, readall())
+end
+
+-- Raw pipe
+
+if lc.rawpipe then
+  local r,w = lc.rawpipe()
+  test(5, w:write('hello'))
+  test(6, w:writev(' ', 'world'))
+  test('hel', r:read(3))
+  local a, b = r:readv(2, 4)
+  test('lo', a)
+  test(' wor', b)
+  local buf = lc.buffer(16)
+  test(2, r:read_into(buf))
+  test('ld', buf:tostring())
+  test(false, pcall(r.read, r, -1))
+  test(false, pcall(r.readv, r, 1, -1))
+  test(false, pcall(lc.buffer, -1))
+  test(false, pcall(lc.buffer, 2^62))
+  r:nonblock(true)
+  test(false, r:read(10))
+  w:close()
+  test(nil, r:read(10))
+  r:close()
+
+  expect = 'hello world ' .. tostring(math.random())
+  local r,w = lc.rawpipe()
+  local p=lc.spawn{lua,'-e','io.write("' .. expect .. '")',stdout=w}
+  w:close()
+  p:wait()
+  test(expect, r:read(1024))
+  r:close()
+
+  local r,w = lc.rawpipe{nonblock=true}
+  test(false, r:read(1))
+  r:close()
+  w:close()
+end
+
+-- Run
+
+if lc.run then
+  local engines = {'poll'}
+  if lc.engine('io_uring') then engines[2] = 'io_uring' end
+  for _, engine in ipairs(engines) do
+    test(engine, lc.engine(engine))
+    local input = string.rep('x', 200000)
+    local res = lc.run{lua,'-e','local s = io.read("*a") io.write(#s) io.stderr:write("err") os.exit(5)', input=input}
+    test(5, res.code)
+    test('200000', res.stdout)
+    test('err', res.stderr)
+
+    local res = lc.run{lua,'-e','io.write(string.rep("a", 300000)) io.stderr:write(string.rep("b", 300000))', max_output=1000}
+    test(1000, #res.stdout)
+    test(1000, #res.stderr)
+    test(true, res.truncated)
+
+    local res = lc.run{lua,'-e','io.write("out")', capture={'stderr'}, stdout=io.stdout}
+    test(nil, res.stdout)
+    test('', res.stderr)
+
+    local res = lc.run{lua,'-e','os.exit(4)', input=string.rep('y', 1000000)}
+    test(4, res.code)
+  end
+  test(nil, (lc.engine('nope')))
+  test(false, pcall(lc.run, {'true', max_output=-1}))
+  test(false, pcall(lc.run, {'true', max_output=0/0}))
+  test(false, pcall(lc.run, {'true', max_output=1.5}))
+  test(false, pcall(lc.run, {'true', max_output='10'}))
+end
+
+-- Pipeline
+
+if lc.pipeline then
+  local r, w = lc.pipe()
+  local stage = {lua,'-e','io.write((io.read("*a"):gsub("a", "b")))'}
+  local pl = lc.pipeline{
+    {lua,'-e','io.write("aaa") os.exit(3)'},
+    stage,
+    stage,
+    stdout=w,
+  }
+  w:close()
+  test('bbb', r:read('*a'))
+  r:close()
+  local a, b, c = pl:wait()
+  test(3, a)
+  test(0, b)
+  test(0, c)
+  test(lua, stage[1])
+  local r2, w2
+  r, w = lc.pipe()
+  r2, w2 = lc.pipe()
+  pl = lc.pipeline{
+    {lua,'-e','io.write("first")', stdout=w2},
+    {lua,'-e','io.write(io.read("*a"), "second")'},
+    stdout=w,
+  }
+  w:close()
+  w2:close()
+  test('first', r2:read('*a'))
+  test('second', r:read('*a'))
+  r:close()
+  r2:close()
+  pl:wait()
+end
+
 -- Passing any character to the child process
 
 for c = 0, 255 do